@@ -1,3 +1,7 @@
 #!/bin/bash
 # Script to compile and execute a c program
-gcc -ansi -Wall -Wextra -Werror -pedantic-errors spkmeans.c -lm -o spkmeans
\ No newline at end of file
+# NSC_NATIVE=1 bash comp.sh builds the AVX2/FMA kernels
+if [[ $NSC_NATIVE == "1" ]]; then
+  native="-mavx2 -mfma"
+fi
+gcc -ansi -Wall -Wextra -Werror -pedantic-errors $native spkmeans.c -lm -lpthread -o spkmeans
\ No newline at end of file
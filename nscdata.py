@@ -0,0 +1,59 @@
+import struct
+import sys
+from argparse import *
+import numpy as np
+import pandas as pd
+
+# the binary data points format read by spkmeans and finalmodule, see spkmeans.h
+MAGIC = b"NSCDATA\0"
+VERSION = 1
+HEADER = struct.Struct("<8sIIQQ")  # magic, version, dtype, n, d
+DTYPES = {1: np.dtype("<f8"), 2: np.dtype("<f4")}
+
+
+def is_binary(file_name):
+    """
+    checks if the given file starts with the binary format's magic.
+    """
+    with open(file_name, "rb") as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+
+def read_binary(file_name):
+    """
+    maps a binary data points file.
+    :return: the n x d points, a read only memory map of the file for float64 values.
+    """
+    with open(file_name, "rb") as f:
+        magic, version, dtype, n, d = HEADER.unpack(f.read(HEADER.size))
+    if magic != MAGIC or version != VERSION or dtype not in DTYPES:
+        raise ValueError(f"{file_name} is not a version {VERSION} data points file")
+    return np.memmap(file_name, dtype=DTYPES[dtype], mode="r", offset=HEADER.size, shape=(n, d))
+
+
+def write_binary(data_points, file_name, dtype=1):
+    """
+    writes the n x d data points in the binary format.
+    :param dtype: 1 for float64 values, 2 for float32.
+    """
+    data_points = np.ascontiguousarray(data_points, dtype=DTYPES[dtype])
+    with open(file_name, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, dtype, *data_points.shape))
+        f.write(data_points.tobytes())
+
+
+def main():
+    """
+    converts a comma separated data points file (e.g. input_1.txt) to the binary format.
+    """
+    parser = ArgumentParser()
+    parser.add_argument("input_file", type=str)
+    parser.add_argument("output_file", type=str)
+    parser.add_argument("--float32", action="store_true")
+    args = parser.parse_args()
+    data_points = pd.read_csv(args.input_file, header=None).to_numpy()
+    write_binary(data_points, args.output_file, 2 if args.float32 else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,5 +1,11 @@
+import os
+
 from setuptools import setup, find_packages, Extension
 
+# NSC_NATIVE=1 builds the AVX2/FMA kernels, the module then only runs on
+# CPUs that have them
+NATIVE_ARGS = ['-mavx2', '-mfma'] if os.environ.get('NSC_NATIVE') == '1' else []
+
 setup(
     name='finalmodule',
     version='0.0.1',
@@ -17,7 +23,8 @@ setup(
     ext_modules=[
         Extension(
             'finalmodule',
-            ['spkmeansmodule.c', 'spkmeans.c']
+            ['spkmeansmodule.c', 'spkmeans.c'],
+            extra_compile_args=NATIVE_ARGS
         )
     ]
 )
\ No newline at end of file
@@ -1,9 +1,20 @@
+#define _POSIX_C_SOURCE 200112L
 #include "stdio.h"
 #include "stdlib.h"
 #include "spkmeans.h"
 #include "assert.h"
 #include "string.h"
 #include "math.h"
+#include "float.h"
+#include "limits.h"
+#include "pthread.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#ifdef __AVX2__
+#include "immintrin.h"
+#endif
 /******************************************************************************
 
 @author: mohammad daghash
@@ -18,14 +29,14 @@ Implementation of the Normalized Spectral Clustering algorithm.
 /* standalone client */
 int main(int argc, char **argv) {
   /* declarations */
-  double *data_points;
-  int n, d;
+  DataFile data_file;
+  int i, num_threads = 1;
   Goal user_goal; /* Goal is an enum. see header for more info. */
   Nsc nsc; /* Nsc is a struct representing
  * a data structure to support all the possible goals. */
 
   /* argument processing and validation */
-  if (argc != 3) {
+  if (argc < 3) {
     InvalidInput();
     exit(1);
   }
@@ -43,37 +54,109 @@ int main(int argc, char **argv) {
   }
   /* Parsing the input file and initialize a Nsc data structure */
 
-  CalculateNandD(argv[2], &n, &d);
-  AllocateMatrix(&data_points, n, d);
-  BuildDataPointsMatrix(argv[2], data_points);
-  ConstructNsc(&nsc, data_points, n, d, user_goal);
+  /* the loader is threaded too, look for --threads first */
+  for (i = 3; i < argc; ++i)
+    if (!strncmp(argv[i], "--threads=", 10) && atoi(argv[i] + 10) > 0)
+      num_threads = atoi(argv[i] + 10);
+  if (!OpenDataFile(argv[2], num_threads, &data_file)) {
+    InvalidInput();
+    exit(1);
+  }
+  ConstructNsc(&nsc, data_file.points, data_file.n, data_file.d, user_goal);
+  /* optional arguments, e.g. --eigen=cyclic --threads=8 */
+  for (i = 3; i < argc; ++i) {
+    if (!ParseOption(argv[i], &nsc)) {
+      InvalidInput();
+      DestructNsc(&nsc);
+      CloseDataFile(&data_file);
+      exit(1);
+    }
+  }
   /* run the required calculation based on the given goal */
-  ChooseGoal(&nsc);
+  if (!ChooseGoal(&nsc)) {
+    GeneralError();
+    DestructNsc(&nsc);
+    CloseDataFile(&data_file);
+    exit(1);
+  }
   /* Used memory de-allocation */
-  FreeMatrix(&data_points);
   DestructNsc(&nsc);
+  CloseDataFile(&data_file);
   return 0;
 }
 
-void PrintMatrix(const double *matrix, int n, int d) {
-  int i, j;
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < d; ++j) {
-      printf("%.4f", matrix[i * d + j]);
-      if (j != d - 1)
-        printf(",");
-    }
-    printf("\n");
+int ParseOption(const char *option, Nsc *nsc) {
+  /* returns 1 if option was recognized and applied, 0 otherwise */
+  if (!strcmp(option, "--eigen=classic")) {
+    nsc->eigen_solver = CLASSIC_JACOBI;
+    nsc->valid_stages &= ~STAGE_EIGEN;
+  } else if (!strcmp(option, "--eigen=cyclic")) {
+    nsc->eigen_solver = CYCLIC_JACOBI;
+    nsc->valid_stages &= ~STAGE_EIGEN;
+  } else if (!strcmp(option, "--eigen=ql")) {
+    nsc->eigen_solver = HOUSEHOLDER_QL;
+    nsc->valid_stages &= ~STAGE_EIGEN;
+  } else if (!strcmp(option, "--eigen=lanczos")) {
+    nsc->eigen_solver = LANCZOS;
+    nsc->valid_stages &= ~STAGE_EIGEN;
+  } else if (!strncmp(option, "--knn=", 6)) {
+    nsc->graph = KNN_GRAPH;
+    nsc->num_neighbours = atoi(option + 6);
+    nsc->valid_stages = 0;
+    if (nsc->num_neighbours < 1)
+      return 0;
+  } else if (!strncmp(option, "--cutoff=", 9)) {
+    nsc->graph = CUTOFF_GRAPH;
+    nsc->cutoff = atof(option + 9);
+    nsc->valid_stages = 0;
+    if (!(nsc->cutoff > 0 && nsc->cutoff <= 1))
+      return 0;
+  } else if (!strcmp(option, "--stream")) {
+    nsc->stream_rows = STREAM_ROWS;
+  } else if (!strncmp(option, "--stream=", 9)) {
+    nsc->stream_rows = atoi(option + 9);
+    if (nsc->stream_rows < 1)
+      return 0;
+  } else if (!strncmp(option, "--threads=", 10)) {
+    nsc->num_threads = atoi(option + 10);
+    if (nsc->num_threads < 1)
+      return 0;
+  } else {
+    return 0;
   }
+  return 1;
 }
 void AllocateMatrix(double **matrix, int n, int d) {
-  *matrix = calloc(n * d, sizeof(double));
+  *matrix = calloc((size_t) n * d, sizeof(double));
+  assert((*matrix) != NULL);
+}
+void AllocateSymmetricMatrix(double **matrix, int n) {
+  *matrix = calloc(PACKED_SIZE(n), sizeof(double));
   assert((*matrix) != NULL);
 }
 void FreeMatrix(double **matrix) {
   free(*matrix);
   *matrix = NULL;
 }
+void AllocateSparseMatrix(SparseMatrix **matrix, int n, size_t nnz) {
+  *matrix = malloc(sizeof(SparseMatrix));
+  assert((*matrix) != NULL);
+  (*matrix)->n = n;
+  (*matrix)->row_start = calloc((size_t) n + 1, sizeof(size_t));
+  (*matrix)->columns = calloc(nnz > 0 ? nnz : 1, sizeof(int));
+  (*matrix)->values = calloc(nnz > 0 ? nnz : 1, sizeof(double));
+  assert((*matrix)->row_start != NULL && (*matrix)->columns != NULL
+             && (*matrix)->values != NULL);
+}
+void FreeSparseMatrix(SparseMatrix **matrix) {
+  if (*matrix == NULL)
+    return;
+  free((*matrix)->row_start);
+  free((*matrix)->columns);
+  free((*matrix)->values);
+  free(*matrix);
+  *matrix = NULL;
+}
 
 void InvalidInput() {
   printf("Invalid Input!");
@@ -81,92 +164,786 @@ void InvalidInput() {
 void GeneralError() {
   printf("An Error Has Occurred");
 }
-void ChooseGoal(Nsc *nsc) {
+int ChooseGoal(Nsc *nsc) {
+  /* returns 0 if the goal could not be computed */
+  if (nsc->stream_rows > 0 && nsc->graph == DENSE_GRAPH
+      && (nsc->goal == WAM || nsc->goal == DDG || nsc->goal == LNORM)) {
+    StreamGoal(nsc);
+    return 1;
+  }
   switch (nsc->goal) {
     case WAM:CalculateWeightedAdjacencyMatrix(nsc);
-      PrintMatrix(nsc->wam, nsc->n, nsc->n);
+      if (nsc->graph != DENSE_GRAPH)
+        PrintSparseMatrix(NscThreadPool(nsc), nsc->sparse_wam);
+      else
+        PrintSymmetricMatrix(NscThreadPool(nsc), nsc->wam, nsc->n);
       break;
     case DDG:CalculateDiagonalDegreeMatrix(nsc);
-      PrintMatrix(nsc->ddg, nsc->n, nsc->n);
+      PrintDiagonalMatrix(NscThreadPool(nsc), nsc->ddg, nsc->n);
       break;
     case LNORM:CalculateNormalizedGraphLaplacian(nsc);
-      PrintMatrix(nsc->l_norm, nsc->n, nsc->n);
+      if (nsc->graph != DENSE_GRAPH)
+        PrintSparseMatrix(NscThreadPool(nsc), nsc->sparse_l_norm);
+      else
+        PrintSymmetricMatrix(NscThreadPool(nsc), nsc->l_norm, nsc->n);
       break;
-    case JACOBI:CalculateJacobi(nsc);
-      PrintMatrix(nsc->eigen_values, 1, nsc->n);
-      PrintMatrix(nsc->eigen_vectors, nsc->n, nsc->n);
+    case JACOBI:CalculateEigenpairs(nsc);
+      if (nsc->num_eigen == 0)
+        return 0;
+      PrintMatrix(NscThreadPool(nsc), nsc->eigen_values, 1, nsc->num_eigen);
+      PrintMatrix(NscThreadPool(nsc), nsc->eigen_vectors, nsc->n,
+                  nsc->num_eigen);
       break;
     case FIT:
     default:break;
   }
+  return 1;
 }
 
 /*
  * library functions implementation
  */
 
-void CalculateWeightedAdjacencyMatrix(Nsc *nsc) {
-  double w_ij;
-  int i, j;
-  /* calculates the Weighted Adjacency Matrix.
-   * https://moodle.tau.ac.il/mod/forum/discuss.php?d=127889
-   * - use standard euclidean norm as defined in the project specification */
-  /* we do not allow self loops, so we set w_ii = 0 for all I’s */
+/****** Affinity kernel
+ * The weights are computed WEIGHT_TILE x WEIGHT_TILE pairs at a time with
+ * ||x - y||^2 = ||x||^2 + ||y||^2 - 2 x.y, the dot products of a tile
+ * being a small matrix product of row blocks of nsc->matrix.
+ * The expansion loses the digits that ||x||^2 and ||y||^2 share, so for
+ * points far from the origin relative to their distance it can be badly
+ * off. A pair whose ||x - y||^2 comes out below CANCELLATION_RATIO of
+ * ||x||^2 + ||y||^2 is recomputed from the differences.
+ * With AVX2 enabled (NSC_NATIVE=1 builds) the dot products and square
+ * roots use 4 wide vectors, exp is libm's in both builds *****/
+#define WEIGHT_TILE 64
+#define CANCELLATION_RATIO 1e-6
 
-  for (i = 0; i < nsc->n; ++i) {
-    (nsc->wam)[i * nsc->n + i] = 0; /* wam[i][i] = 0 */
+#ifdef __AVX2__
+static double SumLanes(__m256d v) {
+  double lanes[4];
+  _mm256_storeu_pd(lanes, v);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#endif
+
+static void Dots2x2(const double *x_a, const double *x_b, const double *y_a,
+                    const double *y_b, int d, double dots[4]) {
+  /* x_a.y_a, x_a.y_b, x_b.y_a, x_b.y_b, every row is loaded once */
+  int k = 0;
+  double aa = 0, ab = 0, ba = 0, bb = 0;
+#ifdef __AVX2__
+  __m256d v_aa = _mm256_setzero_pd(), v_ab = _mm256_setzero_pd(),
+      v_ba = _mm256_setzero_pd(), v_bb = _mm256_setzero_pd(), xa, xb, ya, yb;
+  for (; k + 4 <= d; k += 4) {
+    xa = _mm256_loadu_pd(x_a + k);
+    xb = _mm256_loadu_pd(x_b + k);
+    ya = _mm256_loadu_pd(y_a + k);
+    yb = _mm256_loadu_pd(y_b + k);
+    v_aa = _mm256_add_pd(v_aa, _mm256_mul_pd(xa, ya));
+    v_ab = _mm256_add_pd(v_ab, _mm256_mul_pd(xa, yb));
+    v_ba = _mm256_add_pd(v_ba, _mm256_mul_pd(xb, ya));
+    v_bb = _mm256_add_pd(v_bb, _mm256_mul_pd(xb, yb));
+  }
+  aa = SumLanes(v_aa);
+  ab = SumLanes(v_ab);
+  ba = SumLanes(v_ba);
+  bb = SumLanes(v_bb);
+#endif
+  for (; k < d; ++k) {
+    aa += x_a[k] * y_a[k];
+    ab += x_a[k] * y_b[k];
+    ba += x_b[k] * y_a[k];
+    bb += x_b[k] * y_b[k];
+  }
+  dots[0] = aa;
+  dots[1] = ab;
+  dots[2] = ba;
+  dots[3] = bb;
+}
+
+static void TileDots(const double *x, int d, int i0, int i1, int j0, int j1,
+                     double dots[]) {
+  /* dots[(i - i0) * WEIGHT_TILE + j - j0] = x_i.x_j, in 2x2 blocks. at an
+   * odd edge the last row (column) is paired with itself */
+  int i, j, i_b, j_b;
+  double block[4];
+  for (i = i0; i < i1; i += 2) {
+    i_b = i + 1 < i1 ? i + 1 : i;
+    for (j = j0; j < j1; j += 2) {
+      j_b = j + 1 < j1 ? j + 1 : j;
+      Dots2x2(x + (size_t) i * d, x + (size_t) i_b * d, x + (size_t) j * d,
+              x + (size_t) j_b * d, d, block);
+      dots[(i - i0) * WEIGHT_TILE + j - j0] = block[0];
+      dots[(i - i0) * WEIGHT_TILE + j_b - j0] = block[1];
+      dots[(i_b - i0) * WEIGHT_TILE + j - j0] = block[2];
+      dots[(i_b - i0) * WEIGHT_TILE + j_b - j0] = block[3];
+    }
   }
+}
 
-  /* assign weights with respect to symmetry
-   * running on upper triangle indices only */
+static void SquareRoots(double v[], int count) {
+  int k = 0;
+#ifdef __AVX2__
+  for (; k + 4 <= count; k += 4)
+    _mm256_storeu_pd(v + k, _mm256_sqrt_pd(_mm256_loadu_pd(v + k)));
+#endif
+  for (; k < count; ++k)
+    v[k] = sqrt(v[k]);
+}
+
+static double SquaredDistance(const double x[], const double y[], int d) {
+  double sum = 0, difference;
+  int k;
+  for (k = 0; k < d; ++k) {
+    difference = y[k] - x[k];
+    sum += difference * difference;
+  }
+  return sum;
+}
+
+static void SquaredNorms(const Nsc *nsc, double norms[]) {
+  const double *x;
+  int i, k, d = nsc->d;
   for (i = 0; i < nsc->n; ++i) {
-    for (j = i + 1; j < nsc->n; ++j) {
-      /* helper function to calculate the weight */
-      w_ij = CalculateWeight(i, j, nsc);
-      (nsc->wam)[i * nsc->n + j] = w_ij; /* wam[i][j] = w_ij */
-      (nsc->wam)[j * nsc->n + i] = w_ij; /* wam[i][j] = w_ij */
+    x = nsc->matrix + (size_t) i * d;
+    norms[i] = 0;
+    for (k = 0; k < d; ++k)
+      norms[i] += x[k] * x[k];
+  }
+}
+
+static void WeightsFromDots(const Nsc *nsc, const double norms[], int i,
+                            double dots[], int j_begin, int j_end,
+                            double weights[]) {
+  /* weights[j] = w_ij for j_begin <= j < j_end from dots[j] = x_i.x_j. the
+   * terms are symmetric in i and j, so w_ij and w_ji are the same value */
+  int j, d = nsc->d;
+  double squared;
+  for (j = j_begin; j < j_end; ++j) {
+    squared = norms[i] + norms[j] - 2 * dots[j];
+    if (squared < CANCELLATION_RATIO * (norms[i] + norms[j]))
+      squared = SquaredDistance(nsc->matrix + (size_t) i * d,
+                                nsc->matrix + (size_t) j * d, d);
+    /* rounding can leave a tiny negative for (nearly) equal points */
+    dots[j] = squared > 0 ? squared : 0;
+  }
+  if (j_begin < j_end)
+    SquareRoots(dots + j_begin, j_end - j_begin);
+  for (j = j_begin; j < j_end; ++j)
+    weights[j] = exp(-0.5 * dots[j]);
+}
+
+static void WeightTile(Nsc *nsc, const double norms[], double dots[],
+                       int i0, int j0) {
+  /* wam[i][j] for i0 <= i < j, j0 <= j in one tile, j0 >= i0 */
+  int n = nsc->n, i, j_begin,
+      i1 = i0 + WEIGHT_TILE < n ? i0 + WEIGHT_TILE : n,
+      j1 = j0 + WEIGHT_TILE < n ? j0 + WEIGHT_TILE : n;
+  double *row;
+  TileDots(nsc->matrix, nsc->d, i0, i1, j0, j1, dots);
+  for (i = i0; i < i1; ++i) {
+    row = nsc->wam + PACKED_ROW(i, n);
+    j_begin = j0 > i ? j0 : i + 1;
+    if (i >= j0)
+      row[i] = 0; /* we do not allow self loops, so w_ii = 0 */
+    WeightsFromDots(nsc, norms, i, dots + (i - i0) * WEIGHT_TILE - j0,
+                    j_begin, j1, row);
+  }
+}
+
+typedef struct {
+  Nsc *nsc;
+  const double *norms;
+  int tile_rows; /* number of WEIGHT_TILE row blocks */
+} WeightTiles;
+
+static void WeightTileRange(void *args, int begin, int end) {
+  /* tiles [begin, end) of the upper triangle, numbered row by row. tiles
+   * cost about the same, so equal counts balance the threads */
+  WeightTiles *tiles = (WeightTiles *) args;
+  double *dots;
+  int t = 0, tile_i = 0, tile_j;
+  AllocateMatrix(&dots, WEIGHT_TILE, WEIGHT_TILE);
+  while (t + tiles->tile_rows - tile_i <= begin) {
+    t += tiles->tile_rows - tile_i;
+    ++tile_i;
+  }
+  tile_j = tile_i + begin - t;
+  for (t = begin; t < end; ++t) {
+    WeightTile(tiles->nsc, tiles->norms, dots, tile_i * WEIGHT_TILE,
+               tile_j * WEIGHT_TILE);
+    if (++tile_j == tiles->tile_rows) {
+      ++tile_i;
+      tile_j = tile_i;
     }
   }
+  FreeMatrix(&dots);
 }
-/* Calculate and output the Diagonal Degree Matrix as described in 1.1.2. */
-void CalculateDiagonalDegreeMatrix(Nsc *nsc) {
-  double val;
+
+static void DegreeRows(void *args, int begin, int end) {
+  /* the degrees of rows [begin, end). w_ij is added to the degrees of both
+   * i and j while row i is read, the left part of the rows of this range
+   * comes from the rows above it. every degree still receives its row in
+   * the order w_i0, w_i1, ..., so the sums equal a plain row scan */
+  Nsc *nsc = (Nsc *) args;
+  const double *row;
   int i, j, n = nsc->n;
-  CalculateWeightedAdjacencyMatrix(nsc);
-  for (i = 0; i < n; i++) {
-    val = 0;
-    for (j = 0; j < n; j++) {
-      val += (nsc->wam)[i * n + j];
+  double *ddg = nsc->ddg;
+  for (i = begin; i < end; i++)
+    ddg[i] = 0;
+  for (i = 0; i < end; i++) {
+    row = nsc->wam + PACKED_ROW(i, n);
+    if (i < begin) {
+      for (j = begin; j < end; j++)
+        ddg[j] += row[j];
+      continue;
+    }
+    ddg[i] += row[i];
+    for (j = i + 1; j < end; j++) {
+      ddg[i] += row[j];
+      ddg[j] += row[j];
+    }
+    for (; j < n; j++)
+      ddg[i] += row[j];
+  }
+}
+
+static void LaplacianRows(void *args, int begin, int end) {
+  /* item u owns rows u and n - 1 - u of the packed triangle, so every item
+   * covers n + 1 elements. l_ij = delta_ij - (d_i w_ij) d_j */
+  Nsc *nsc = (Nsc *) args;
+  const double *w_row, *d = nsc->inversed_sqrt_ddg;
+  double *l_row;
+  int u, i, j, k, n = nsc->n;
+  for (u = begin; u < end; ++u) {
+    for (k = 0; k < 2; ++k) {
+      i = k == 0 ? u : n - 1 - u;
+      if (k == 1 && i == u)
+        break;
+      w_row = nsc->wam + PACKED_ROW(i, n);
+      l_row = nsc->l_norm + PACKED_ROW(i, n);
+      for (j = i; j < n; ++j)
+        l_row[j] = (i == j ? 1.0 : 0.0) - d[i] * w_row[j] * d[j];
+    }
+  }
+}
+
+/****** Sparse graph
+ * Only the num_neighbours nearest points of every point (KNN_GRAPH), or
+ * the pairs with w_ij >= cutoff (CUTOFF_GRAPH), are kept in CSR form. A k
+ * nearest neighbours relation is not symmetric, the graph keeps w_ij when
+ * j is near i or i is near j. w_ij is computed as in CalculateWeight in
+ * both directions, so the values agree.
+ * For d <= KD_TREE_MAX_DIMENSION the queries go through a KD-tree over
+ * nsc->matrix, with the same results as a scan of all points *****/
+typedef struct {
+  int column;
+  double value;
+} SparseEntry;
+
+#define KD_TREE_LEAF 16
+#define KD_TREE_MAX_DIMENSION 16
+
+typedef struct {
+  int begin, end; /* the points tree->index[begin, end) */
+  int left, right; /* child nodes, -1 for a leaf */
+  int dimension;
+  double split; /* left points have x[dimension] <= split <= right ones */
+} KdNode;
+
+typedef struct {
+  const double *x;
+  int n, d, num_nodes;
+  int *index;
+  KdNode *nodes;
+} KdTree;
+
+typedef struct {
+  Nsc *nsc;
+  KdTree *tree; /* NULL: every query scans all the points */
+  int k; /* KNN_GRAPH: neighbours per point */
+  int *neighbours; /* KNN_GRAPH: n x k, nearest first */
+  double *weights; /* KNN_GRAPH: n x k */
+  SparseMatrix *graph; /* CUTOFF_GRAPH: row_start[i + 1] counts, then
+                        * the entries are filled in */
+  int fill;
+} NeighbourSearch;
+
+static int KdBuild(KdTree *tree, int begin, int end) {
+  /* splits the widest dimension of the node's points at the median,
+   * returns the node */
+  KdNode *node;
+  const double *x = tree->x;
+  double low, high, value, widest = -1, pivot;
+  int id = tree->num_nodes++, k, p, left, right, less, greater, swap,
+      median, d = tree->d, *index = tree->index;
+  node = &tree->nodes[id]; /* preallocated, children do not move it */
+  node->begin = begin;
+  node->end = end;
+  node->left = node->right = -1;
+  if (end - begin <= KD_TREE_LEAF)
+    return id;
+  for (k = 0; k < d; ++k) {
+    low = high = x[(size_t) index[begin] * d + k];
+    for (p = begin + 1; p < end; ++p) {
+      value = x[(size_t) index[p] * d + k];
+      low = value < low ? value : low;
+      high = value > high ? value : high;
+    }
+    if (high - low > widest) {
+      widest = high - low;
+      node->dimension = k;
+    }
+  }
+  k = node->dimension;
+  median = begin + (end - begin) / 2;
+  left = begin;
+  right = end;
+  for (;;) { /* quickselect, three way so equal values cannot stall it */
+    pivot = x[(size_t) index[left + (right - left) / 2] * d + k];
+    less = left;
+    greater = right;
+    for (p = left; p < greater;) {
+      value = x[(size_t) index[p] * d + k];
+      swap = index[p];
+      if (value < pivot) {
+        index[p++] = index[less];
+        index[less++] = swap;
+      } else if (value > pivot) {
+        index[p] = index[--greater];
+        index[greater] = swap;
+      } else {
+        ++p;
+      }
+    }
+    if (median < less)
+      right = less;
+    else if (median >= greater)
+      left = greater;
+    else
+      break;
+  }
+  node->split = x[(size_t) index[median] * d + k];
+  node->left = KdBuild(tree, begin, median);
+  node->right = KdBuild(tree, median, end);
+  return id;
+}
+
+static KdTree *CreateKdTree(const double *x, int n, int d) {
+  KdTree *tree = malloc(sizeof(KdTree));
+  int i;
+  assert(tree != NULL);
+  tree->x = x;
+  tree->n = n;
+  tree->d = d;
+  tree->num_nodes = 0;
+  tree->index = calloc((size_t) n + 1, sizeof(int));
+  /* every node holds at least one point, a binary tree has < 2n nodes */
+  tree->nodes = calloc(2 * (size_t) n + 1, sizeof(KdNode));
+  assert(tree->index != NULL && tree->nodes != NULL);
+  for (i = 0; i < n; ++i)
+    tree->index[i] = i;
+  if (n > 0)
+    KdBuild(tree, 0, n);
+  return tree;
+}
+
+static void DestroyKdTree(KdTree *tree) {
+  free(tree->index);
+  free(tree->nodes);
+  free(tree);
+}
+
+static void KdNearest(const KdTree *tree, int id, int query, int k,
+                      int best[], double distances[], int *size) {
+  /* adds the points of node id to the k best of query, ordered by
+   * (distance, index) like a scan in index order. a subtree is skipped
+   * when the splitting plane alone is farther than the k-th best */
+  const KdNode *node = &tree->nodes[id];
+  const double *q = tree->x + (size_t) query * tree->d;
+  double squared, plane;
+  int p, j, t;
+  if (node->left == -1) {
+    for (p = node->begin; p < node->end; ++p) {
+      j = tree->index[p];
+      if (j == query)
+        continue;
+      squared = SquaredDistance(q, tree->x + (size_t) j * tree->d, tree->d);
+      if (*size == k && (squared > distances[k - 1]
+          || (squared == distances[k - 1] && j > best[k - 1])))
+        continue;
+      t = *size < k ? (*size)++ : k - 1;
+      for (; t > 0 && (distances[t - 1] > squared
+          || (distances[t - 1] == squared && best[t - 1] > j)); --t) {
+        distances[t] = distances[t - 1];
+        best[t] = best[t - 1];
+      }
+      distances[t] = squared;
+      best[t] = j;
     }
-    (nsc->ddg)[i * nsc->n + i] = val;
+    return;
   }
+  plane = node->split - q[node->dimension];
+  KdNearest(tree, plane >= 0 ? node->left : node->right, query, k, best,
+            distances, size);
+  if (*size < k || plane * plane <= distances[k - 1])
+    KdNearest(tree, plane >= 0 ? node->right : node->left, query, k, best,
+              distances, size);
+}
+
+static size_t KdWithin(const KdTree *tree, int id, int query, double radius,
+                       int found[]) {
+  /* the points other than query within squared distance radius of it,
+   * written to found unless it is NULL. returns their number */
+  const KdNode *node = &tree->nodes[id];
+  const double *q = tree->x + (size_t) query * tree->d;
+  double plane;
+  size_t count = 0;
+  int p, j;
+  if (node->left == -1) {
+    for (p = node->begin; p < node->end; ++p) {
+      j = tree->index[p];
+      if (j != query && SquaredDistance(q, tree->x + (size_t) j * tree->d,
+                                        tree->d) <= radius) {
+        if (found != NULL)
+          found[count] = j;
+        ++count;
+      }
+    }
+    return count;
+  }
+  plane = node->split - q[node->dimension];
+  if (plane >= 0 || plane * plane <= radius)
+    count += KdWithin(tree, node->left, query, radius, found);
+  if (plane <= 0 || plane * plane <= radius)
+    count += KdWithin(tree, node->right, query, radius,
+                      found != NULL ? found + count : NULL);
+  return count;
+}
+
+static int CompareIndices(const void *first, const void *second) {
+  int a = *(const int *) first, b = *(const int *) second;
+  return (a > b) - (a < b);
+}
+
+static void NearestNeighbourRows(void *args, int begin, int end) {
+  /* the k nearest other points of rows [begin, end), kept sorted by
+   * insertion. on ties the smaller index wins */
+  NeighbourSearch *search = (NeighbourSearch *) args;
+  Nsc *nsc = search->nsc;
+  const double *x = nsc->matrix;
+  double *distances, squared;
+  int i, j, t, size, *best, k = search->k, n = nsc->n, d = nsc->d;
+  for (i = begin; i < end; ++i) {
+    best = search->neighbours + (size_t) i * k;
+    distances = search->weights + (size_t) i * k;
+    size = 0;
+    if (search->tree != NULL && k > 0)
+      KdNearest(search->tree, 0, i, k, best, distances, &size);
+    for (j = 0; search->tree == NULL && j < n; ++j) {
+      if (j == i)
+        continue;
+      squared = SquaredDistance(x + (size_t) i * d, x + (size_t) j * d, d);
+      if (size == k && squared >= distances[k - 1])
+        continue;
+      t = size < k ? size++ : k - 1;
+      for (; t > 0 && distances[t - 1] > squared; --t) {
+        distances[t] = distances[t - 1];
+        best[t] = best[t - 1];
+      }
+      distances[t] = squared;
+      best[t] = j;
+    }
+    for (t = 0; t < k; ++t)
+      distances[t] = exp(-0.5 * sqrt(distances[t]));
+  }
+}
+
+static void CutoffRows(void *args, int begin, int end) {
+  /* rows [begin, end) of the cutoff graph. the first pass (fill == 0)
+   * counts the entries, the second writes them. with a tree, the points
+   * within the distance of the cutoff (a bit beyond it, the weight decides)
+   * are the candidates, sorted into index order */
+  NeighbourSearch *search = (NeighbourSearch *) args;
+  Nsc *nsc = search->nsc;
+  SparseMatrix *graph = search->graph;
+  const double *x = nsc->matrix;
+  double weight, radius = -2 * log(nsc->cutoff);
+  size_t entry, c, num_candidates = 0;
+  int i, j, n = nsc->n, d = nsc->d, *candidates = NULL;
+  radius = radius * radius * (1 + 1e-9) + 1e-30;
+  if (search->tree != NULL) {
+    candidates = calloc((size_t) n + 1, sizeof(int));
+    assert(candidates != NULL);
+  }
+  for (i = begin; i < end; ++i) {
+    entry = search->fill ? graph->row_start[i] : 0;
+    if (search->tree != NULL) {
+      num_candidates = KdWithin(search->tree, 0, i, radius, candidates);
+      qsort(candidates, num_candidates, sizeof(int), CompareIndices);
+    }
+    for (c = 0; c < (search->tree != NULL ? num_candidates : (size_t) n);
+         ++c) {
+      j = search->tree != NULL ? candidates[c] : (int) c;
+      if (j == i)
+        continue;
+      weight = exp(-0.5 * sqrt(SquaredDistance(x + (size_t) i * d,
+                                               x + (size_t) j * d, d)));
+      if (weight < nsc->cutoff)
+        continue;
+      if (search->fill) {
+        graph->columns[entry] = j;
+        graph->values[entry] = weight;
+      }
+      ++entry;
+    }
+    if (!search->fill)
+      graph->row_start[i + 1] = entry;
+  }
+  free(candidates);
+}
+
+static int CompareEntries(const void *first, const void *second) {
+  const SparseEntry *a = (const SparseEntry *) first,
+      *b = (const SparseEntry *) second;
+  return (a->column > b->column) - (a->column < b->column);
+}
+
+static SparseMatrix *SymmetrizeNeighbours(const NeighbourSearch *search,
+                                          int n) {
+  /* row i of the graph: the neighbours of i and the points i is a
+   * neighbour of, sorted, with the mutual pairs once */
+  SparseMatrix *graph;
+  SparseEntry *entries;
+  size_t *start, *fill, nnz = 0, e;
+  int i, t, j, k = search->k;
+  start = calloc((size_t) n + 1, sizeof(size_t));
+  fill = calloc((size_t) n, sizeof(size_t));
+  assert(start != NULL && fill != NULL);
+  for (i = 0; i < n; ++i)
+    for (t = 0; t < k; ++t)
+      ++start[search->neighbours[(size_t) i * k + t] + 1];
+  for (i = 0; i < n; ++i)
+    start[i + 1] += start[i] + k;
+  entries = malloc((start[n] > 0 ? start[n] : 1) * sizeof(SparseEntry));
+  assert(entries != NULL);
+  for (i = 0; i < n; ++i) {
+    for (t = 0; t < k; ++t) {
+      j = search->neighbours[(size_t) i * k + t];
+      entries[start[i] + fill[i]].column = j;
+      entries[start[i] + fill[i]++].value =
+          search->weights[(size_t) i * k + t];
+      entries[start[j] + fill[j]].column = i;
+      entries[start[j] + fill[j]++].value =
+          search->weights[(size_t) i * k + t];
+    }
+  }
+  for (i = 0; i < n; ++i) { /* sort and drop the duplicates in place */
+    qsort(entries + start[i], fill[i], sizeof(SparseEntry), CompareEntries);
+    for (e = 0, t = 0; e < fill[i]; ++e)
+      if (t == 0 || entries[start[i] + e].column
+          != entries[start[i] + t - 1].column)
+        entries[start[i] + t++] = entries[start[i] + e];
+    fill[i] = t;
+    nnz += t;
+  }
+  AllocateSparseMatrix(&graph, n, nnz);
+  for (i = 0; i < n; ++i) {
+    graph->row_start[i + 1] = graph->row_start[i] + fill[i];
+    for (e = 0; e < fill[i]; ++e) {
+      graph->columns[graph->row_start[i] + e] = entries[start[i] + e].column;
+      graph->values[graph->row_start[i] + e] = entries[start[i] + e].value;
+    }
+  }
+  free(entries);
+  free(start);
+  free(fill);
+  return graph;
+}
+
+static void SparseDegreeRows(void *args, int begin, int end) {
+  /* missing entries are zeros of the dense row, and adding +0 leaves a
+   * sum unchanged, so these are the dense row sums of the same graph */
+  Nsc *nsc = (Nsc *) args;
+  const SparseMatrix *w = nsc->sparse_wam;
+  size_t e;
+  int i;
+  for (i = begin; i < end; ++i) {
+    nsc->ddg[i] = 0;
+    for (e = w->row_start[i]; e < w->row_start[i + 1]; ++e)
+      nsc->ddg[i] += w->values[e];
+  }
+}
+
+static void SparseLaplacianRows(void *args, int begin, int end) {
+  /* row i of l_norm is row i of the wam scaled, with the diagonal inserted
+   * at its place. l_ij = delta_ij - (d_i w_ij) d_j as in the dense case */
+  Nsc *nsc = (Nsc *) args;
+  const SparseMatrix *w = nsc->sparse_wam;
+  SparseMatrix *l = nsc->sparse_l_norm;
+  const double *d = nsc->inversed_sqrt_ddg;
+  size_t e, out;
+  int i, diagonal;
+  for (i = begin; i < end; ++i) {
+    out = l->row_start[i];
+    diagonal = 0;
+    for (e = w->row_start[i]; e <= w->row_start[i + 1]; ++e) {
+      if (!diagonal && (e == w->row_start[i + 1] || w->columns[e] > i)) {
+        l->columns[out] = i;
+        l->values[out++] = 1.0;
+        diagonal = 1;
+      }
+      if (e == w->row_start[i + 1])
+        break;
+      l->columns[out] = w->columns[e];
+      l->values[out++] = 0.0 - d[i] * w->values[e] * d[w->columns[e]];
+    }
+  }
+}
+
+void CalculateSparseGraph(Nsc *nsc) {
+  NeighbourSearch search;
+  ThreadPool *pool = NscThreadPool(nsc);
+  int i, n = nsc->n;
+  FreeSparseMatrix(&(nsc->sparse_wam));
+  search.nsc = nsc;
+  search.fill = 0;
+  /* past a few dimensions a KD-tree prunes little, scan instead */
+  search.tree = nsc->d <= KD_TREE_MAX_DIMENSION
+                ? CreateKdTree(nsc->matrix, n, nsc->d) : NULL;
+  if (nsc->graph == CUTOFF_GRAPH) {
+    AllocateSparseMatrix(&(search.graph), n, 0);
+    ParallelFor(pool, CutoffRows, &search, n); /* count */
+    for (i = 0; i < n; ++i)
+      search.graph->row_start[i + 1] += search.graph->row_start[i];
+    free(search.graph->columns);
+    free(search.graph->values);
+    search.graph->columns = calloc(search.graph->row_start[n] + 1,
+                                   sizeof(int));
+    search.graph->values = calloc(search.graph->row_start[n] + 1,
+                                  sizeof(double));
+    assert(search.graph->columns != NULL && search.graph->values != NULL);
+    search.fill = 1;
+    ParallelFor(pool, CutoffRows, &search, n);
+    nsc->sparse_wam = search.graph;
+  } else {
+    search.k = nsc->num_neighbours < n - 1 ? nsc->num_neighbours : n - 1;
+    search.neighbours = calloc((size_t) n * search.k + 1, sizeof(int));
+    search.weights = calloc((size_t) n * search.k + 1, sizeof(double));
+    assert(search.neighbours != NULL && search.weights != NULL);
+    ParallelFor(pool, NearestNeighbourRows, &search, n);
+    nsc->sparse_wam = SymmetrizeNeighbours(&search, n);
+    free(search.neighbours);
+    free(search.weights);
+  }
+  if (search.tree != NULL)
+    DestroyKdTree(search.tree);
+}
+
+void CalculateSparseLaplacian(Nsc *nsc) {
+  const SparseMatrix *w = nsc->sparse_wam;
+  int i, n = nsc->n;
+  FreeSparseMatrix(&(nsc->sparse_l_norm));
+  AllocateSparseMatrix(&(nsc->sparse_l_norm), n, w->row_start[n] + n);
+  for (i = 0; i < n; ++i)
+    nsc->sparse_l_norm->row_start[i + 1] = w->row_start[i + 1] + i + 1;
+  ParallelFor(NscThreadPool(nsc), SparseLaplacianRows, nsc, n);
+}
+
+int SparseGraphIsConnected(const SparseMatrix *graph) {
+  /* breadth first search from point 0, queue holds the points reached */
+  int *queue, head, tail = 1, i, n = graph->n;
+  char *reached;
+  size_t e;
+  queue = calloc((size_t) n, sizeof(int));
+  reached = calloc((size_t) n, sizeof(char));
+  assert(queue != NULL && reached != NULL);
+  reached[0] = 1;
+  for (head = 0; head < tail; ++head) {
+    i = queue[head];
+    for (e = graph->row_start[i]; e < graph->row_start[i + 1]; ++e) {
+      if (!reached[graph->columns[e]]) {
+        reached[graph->columns[e]] = 1;
+        queue[tail++] = graph->columns[e];
+      }
+    }
+  }
+  free(queue);
+  free(reached);
+  return tail == n;
+}
+
+void PackSparseMatrix(double packed[], const SparseMatrix *sparse) {
+  size_t e;
+  int i, n = sparse->n;
+  memset(packed, 0, PACKED_SIZE(n) * sizeof(double));
+  for (i = 0; i < n; ++i)
+    for (e = sparse->row_start[i]; e < sparse->row_start[i + 1]; ++e)
+      if (sparse->columns[e] >= i)
+        packed[PACKED_ROW(i, n) + sparse->columns[e]] = sparse->values[e];
+}
+
+void CalculateWeightedAdjacencyMatrix(Nsc *nsc) {
+  WeightTiles tiles;
+  double *norms;
+  int n = nsc->n;
+  /* calculates the Weighted Adjacency Matrix.
+   * https://moodle.tau.ac.il/mod/forum/discuss.php?d=127889
+   * - use standard euclidean norm as defined in the project specification */
+  if (nsc->valid_stages & STAGE_WAM)
+    return;
+  if (nsc->graph != DENSE_GRAPH) {
+    CalculateSparseGraph(nsc);
+    nsc->valid_stages |= STAGE_WAM;
+    return;
+  }
+  if (nsc->wam == NULL)
+    AllocateSymmetricMatrix(&(nsc->wam), n);
+  AllocateMatrix(&norms, 1, n);
+  SquaredNorms(nsc, norms);
+  /* wam is symmetric and stored packed, only the upper triangle tiles are
+   * computed, split evenly between the threads */
+  tiles.nsc = nsc;
+  tiles.norms = norms;
+  tiles.tile_rows = (n + WEIGHT_TILE - 1) / WEIGHT_TILE;
+  ParallelFor(NscThreadPool(nsc), WeightTileRange, &tiles,
+              tiles.tile_rows * (tiles.tile_rows + 1) / 2);
+  FreeMatrix(&norms);
+  nsc->valid_stages |= STAGE_WAM;
+}
+/* Calculate and output the Diagonal Degree Matrix as described in 1.1.2. */
+void CalculateDiagonalDegreeMatrix(Nsc *nsc) {
+  if (nsc->valid_stages & STAGE_DDG)
+    return;
+  CalculateWeightedAdjacencyMatrix(nsc);
+  if (nsc->ddg == NULL)
+    AllocateMatrix(&(nsc->ddg), 1, nsc->n);
+  /* row sums over the packed upper triangle or the sparse rows, a range
+   * of rows per thread */
+  ParallelFor(NscThreadPool(nsc),
+              nsc->graph != DENSE_GRAPH ? SparseDegreeRows : DegreeRows, nsc,
+              nsc->n);
+  nsc->valid_stages |= STAGE_DDG;
 }
 void CalculateNormalizedGraphLaplacian(Nsc *nsc) {
-  /* Declarations */
-  double *identity;
-  double *inversed_dw;
-  double *inversed_dw_inversed_d;
   int n = nsc->n;
-  /* Memory allocation */
-  AllocateMatrix(&identity, n, n);
-  AllocateMatrix(&inversed_dw, n, n);
-  AllocateMatrix(&inversed_dw_inversed_d, n, n);
+  if (nsc->valid_stages & STAGE_L_NORM)
+    return;
   /* Run the first three steps of the algorithm using
-   * the existing goals implementations. */
+   * the existing goals implementations. each runs once per nsc */
   CalculateWeightedAdjacencyMatrix(nsc);
   CalculateDiagonalDegreeMatrix(nsc);
   InversedSqrtDiagonalDegreeMatrix(nsc);
-  IdentityMatrix(identity, n);
-  MultiplyTwoMatrices(nsc->inversed_sqrt_ddg, nsc->wam, inversed_dw, n);
-  MultiplyTwoMatrices(inversed_dw,
-                      nsc->inversed_sqrt_ddg,
-                      inversed_dw_inversed_d,
-                      n);
-  SubTwoMatrices(identity, inversed_dw_inversed_d, nsc->l_norm, n);
-  /* Memory de-allocation*/
-  FreeMatrix(&identity);
-  FreeMatrix(&inversed_dw);
-  FreeMatrix(&inversed_dw_inversed_d);
+  if (nsc->graph != DENSE_GRAPH) {
+    CalculateSparseLaplacian(nsc);
+    nsc->valid_stages |= STAGE_L_NORM;
+    return;
+  }
+  if (nsc->l_norm == NULL)
+    AllocateSymmetricMatrix(&(nsc->l_norm), n);
+  /* D^-1/2 is diagonal, so I - D^-1/2 W D^-1/2 is computed element wise
+   * on the packed upper triangle, see LaplacianRows */
+  ParallelFor(NscThreadPool(nsc), LaplacianRows, nsc, (n + 1) / 2);
+  nsc->valid_stages |= STAGE_L_NORM;
 }
 /**
  * Procedure:
@@ -181,31 +958,152 @@ V = P 1 P 2 P 3 . . .
  * */
 void CalculateJacobi(Nsc *nsc) {
   /* Declerations */
-  double *p, *a_tag, *a, *v;
-  /* v is the product of all rotation matrices p1p2p3... */
+  double *a;
   int n = nsc->n;
-  /* Memory allocation and initializations */
-  AllocateMatrix(&a, n, n);
-  if (nsc->goal == FIT)
-    CopyMatrix(a, nsc->l_norm, n, n);
+  /* Memory allocation and initializations.
+   * The rotations are applied to a and to nsc->eigen_vectors in place, so
+   * no rotation matrix P or A' buffer is needed. */
+  AllocateSymmetricMatrix(&a, n);
+  if (nsc->goal != JACOBI)
+    memcpy(a, nsc->l_norm, PACKED_SIZE(n) * sizeof(double));
   else
-    CopyMatrix(a, nsc->matrix, n, n);
-  AllocateMatrix(&p, n, n);
-  AllocateMatrix(&a_tag, n, n);
-  CopyMatrix(a_tag, a, n, n);
-  AllocateMatrix(&v, n, n);
-  IdentityMatrix(v, n);
-
-  /* Preform calculations until epsilon convergence or
-   * num_iteration exceeds 100 */
-  RunJacobiCalculations(a, a_tag, p, v, n, nsc);
+    PackSymmetricMatrix(a, nsc->matrix, n);
+  AllocateEigenpairs(nsc, n);
+  /* v is the product of all rotation matrices p1p2p3... */
+  IdentityMatrix(nsc->eigen_vectors, n);
+
+  if (nsc->eigen_solver == CYCLIC_JACOBI) {
+    /* sweeps of disjoint rotations until a sweep gains less than epsilon */
+    RunCyclicJacobiSweeps(a, n, nsc);
+  } else {
+    /* Preform calculations until epsilon convergence or
+     * num_iteration exceeds 100 */
+    RunJacobiCalculations(a, n, nsc);
+  }
   /* Memory de-allocation */
   FreeMatrix(&a);
-  FreeMatrix(&a_tag);
-  FreeMatrix(&p);
-  FreeMatrix(&v);
 }
-
+/* Calculate the eigenvalues and eigenvectors with nsc->eigen_solver */
+void CalculateEigenpairs(Nsc *nsc) {
+  if (nsc->valid_stages & STAGE_EIGEN)
+    return;
+  if (nsc->goal != JACOBI && nsc->num_landmarks > 0) {
+    CalculateNystrom(nsc);
+    nsc->valid_stages |= STAGE_EIGEN;
+    return;
+  }
+  /* the input is l_norm, except for the jacobi goal */
+  if (nsc->goal != JACOBI)
+    CalculateNormalizedGraphLaplacian(nsc);
+  /* a sparse l_norm is only ever used through products. every component
+   * of a disconnected graph adds its own copy of the eigenvalues they
+   * share, which one Lanczos start vector does not resolve, so then the
+   * packed l_norm goes to the dense QL solver */
+  if (nsc->goal != JACOBI && nsc->graph != DENSE_GRAPH
+      && SparseGraphIsConnected(nsc->sparse_wam)) {
+    CalculateLanczos(nsc);
+  } else if (nsc->goal != JACOBI && nsc->graph != DENSE_GRAPH) {
+    if (nsc->l_norm == NULL)
+      AllocateSymmetricMatrix(&(nsc->l_norm), nsc->n);
+    PackSparseMatrix(nsc->l_norm, nsc->sparse_l_norm);
+    CalculateHouseholderQL(nsc);
+  } else if (nsc->eigen_solver == HOUSEHOLDER_QL)
+    CalculateHouseholderQL(nsc);
+  else if (nsc->eigen_solver == LANCZOS)
+    CalculateLanczos(nsc);
+  else
+    CalculateJacobi(nsc);
+  nsc->valid_stages |= STAGE_EIGEN;
+}
+/**
+ * Procedure:
+(a) Reduce A to a tridiagonal matrix T = Q^TAQ with n - 2 Householder
+reflections, accumulating Q.
+(b) Diagonalize T with implicit shift QL iterations, applying every plane
+rotation to Q as well.
+(c) The diagonal of the final T is the eigenvalues of A and the columns of
+Q are the eigenvectors.
+ * */
+void CalculateHouseholderQL(Nsc *nsc) {
+  /* Declerations */
+  double *e; /* the off diagonal of T */
+  int n = nsc->n;
+  AllocateEigenpairs(nsc, n);
+  /* Q is built in place of A inside nsc->eigen_vectors */
+  if (nsc->goal != JACOBI)
+    UnpackSymmetricMatrix(nsc->eigen_vectors, nsc->l_norm, n);
+  else
+    CopyMatrix(nsc->eigen_vectors, nsc->matrix, n, n);
+  AllocateMatrix(&e, 1, n);
+  Tridiagonalize(nsc->eigen_vectors, nsc->eigen_values, e, n);
+  if (!TridiagonalQL(nsc->eigen_values, e, nsc->eigen_vectors, n))
+    nsc->num_eigen = 0;
+  FreeMatrix(&e);
+}
+/**
+ * Only the leading (largest, the ones FindK uses) eigenpairs are computed,
+ * with thick restart Lanczos:
+(a) Extend an orthonormal Krylov basis Q of A with full re-orthogonalization,
+keeping H = Q^TAQ.
+(b) Take the Ritz pairs of H. A Ritz pair has converged once its residual
+||Ax - theta x|| (known from H, no extra product) is below epsilon.
+(c) Otherwise restart from the best Ritz vectors and the last residual.
+With nsc->k == 0, m grows until the eigengap FindK would pick is certain,
+see EigengapIsFinal.
+ * */
+void CalculateLanczos(Nsc *nsc) {
+  const double *a = nsc->l_norm;
+  const SparseMatrix *sparse = NULL;
+  double *packed = NULL, trace = 0;
+  size_t e;
+  int n = nsc->n, half = n / 2, m, i;
+  if (nsc->goal == JACOBI) { /* the products run on packed storage */
+    AllocateSymmetricMatrix(&packed, n);
+    PackSymmetricMatrix(packed, nsc->matrix, n);
+    a = packed;
+  } else if (nsc->graph != DENSE_GRAPH) {
+    sparse = nsc->sparse_l_norm;
+    a = NULL;
+  }
+  for (i = 0; i < n; ++i) {
+    if (sparse == NULL) {
+      trace += a[PACKED_ROW(i, n) + i];
+      continue;
+    }
+    for (e = sparse->row_start[i]; e < sparse->row_start[i + 1]; ++e)
+      if (sparse->columns[e] == i)
+        trace += sparse->values[e];
+  }
+  if (nsc->k > 0) {
+    RunLanczos(nsc, a, sparse, nsc->k < n ? nsc->k : n);
+  } else {
+    /* FindK looks at the gaps between the first half + 1 eigenvalues */
+    m = half + 1 < 8 ? half + 1 : 8;
+    for (;;) {
+      RunLanczos(nsc, a, sparse, m);
+      if (m >= half + 1 || EigengapIsFinal(nsc, trace))
+        break;
+      m = 2 * m < half + 1 ? 2 * m : half + 1;
+    }
+  }
+  FreeMatrix(&packed);
+}
+int EigengapIsFinal(const Nsc *nsc, double trace) {
+  /* the gaps after the m known eigenvalues add up to lambda_m-1 -
+   * lambda_half. n - half eigenvalues are <= lambda_half and the ones up to
+   * half are <= lambda_m-1, so their sum, trace(a) - known eigenvalues,
+   * bounds lambda_half from below. if the largest known gap is at least
+   * that spread no later gap can beat it */
+  int i, n = nsc->n, m = nsc->num_eigen, half = n / 2;
+  double rest = trace, max_gap = 0, lower, *values = nsc->eigen_values;
+  for (i = 0; i < m; ++i)
+    rest -= values[i];
+  for (i = 0; i < m - 1; ++i)
+    if (values[i] - values[i + 1] > max_gap)
+      max_gap = values[i] - values[i + 1];
+  lower = (rest - (half - m) * values[m - 1]) / (n - half);
+  return max_gap >= values[m - 1] - lower;
+}
 /*
  * API helper functions
  */
@@ -213,74 +1111,296 @@ void CalculateJacobi(Nsc *nsc) {
 void InversedSqrtDiagonalDegreeMatrix(Nsc *nsc) {
   double val;
   int i;
+  if (nsc->valid_stages & STAGE_INVERSED_SQRT_DDG)
+    return;
+  CalculateDiagonalDegreeMatrix(nsc);
+  if (nsc->inversed_sqrt_ddg == NULL)
+    AllocateMatrix(&(nsc->inversed_sqrt_ddg), 1, nsc->n);
   for (i = 0; i < nsc->n; i++) {
-    val = (nsc->ddg)[i * nsc->n + i];
-    (nsc->inversed_sqrt_ddg)[i * nsc->n + i] = 1 / (sqrt(val));
-  }
-}
-void CalculateRotationMatrix(const double a[], double p[], int n, Nsc *nsc) {
-  int i_pivot, j_pivot;
-  double c, s, theta, t, pivot;
-  pivot = a[1];
-  i_pivot = 0;
-  j_pivot = 1;
-  IdentityMatrix(p, n); /* P = I */
-  FindPivot(a, n, &pivot, &i_pivot, &j_pivot);
-  theta = (a[j_pivot * n + j_pivot] - a[i_pivot * n + i_pivot]) / (2 * pivot);
+    val = (nsc->ddg)[i];
+    /* an isolated point (possible in a sparse graph) gets no scaling */
+    (nsc->inversed_sqrt_ddg)[i] = val > 0 ? 1 / (sqrt(val)) : 0;
+  }
+  nsc->valid_stages |= STAGE_INVERSED_SQRT_DDG;
+}
+void CalculateRotation(const double a[], int n, Nsc *nsc) {
+  /* calculates the c, s values of the rotation matrix P that zeroes the
+   * pivot a[i_pivot][j_pivot]. P itself is never built, see ApplyRotation */
+  int i_pivot = nsc->i_pivot, j_pivot = nsc->j_pivot;
+  double c, s, theta, t, pivot = a[PACKED_ROW(i_pivot, n) + j_pivot];
+  theta = (a[PACKED_ROW(j_pivot, n) + j_pivot]
+      - a[PACKED_ROW(i_pivot, n) + i_pivot]) / (2 * pivot);
   t = Sign(theta) / (fabs(theta) + sqrt(theta * theta + 1));
   c = 1 / (sqrt(t * t + 1));
   s = t * c;
-  p[i_pivot * n + i_pivot] = c;
-  p[j_pivot * n + j_pivot] = c;
-  p[i_pivot * n + j_pivot] = s;
-  p[j_pivot * n + i_pivot] = (-1) * s;
   nsc->s = s;
   nsc->c = c;
-  nsc->i_pivot = i_pivot;
-  nsc->j_pivot = j_pivot;
-}
-void RunJacobiCalculations(double a[],
-                           double a_tag[],
-                           double p[],
-                           double v[],
-                           int n,
-                           Nsc *nsc) {
+}
+void RunJacobiCalculations(double a[], int n, Nsc *nsc) {
   /* Declerations */
-  int num_iteration = 0, i;
-  double convergence = nsc->epsilon + 1;
-  /* v is the partial product of rotation matrecies p1p2p3... */
-  while (num_iteration < 100 && convergence > nsc->epsilon) {
-    if(CheckDiagonal(a,n) == 1){
-      IdentityMatrix(nsc->eigen_vectors, n);
+  int num_iteration = 0, i, *row_max;
+  double convergence = nsc->epsilon + 1, pivot, pivot_tag;
+  /* row_max[i] is the column of the largest |a[i][j]|, j > i. a rotation
+   * changes two rows and columns only, so the index is refreshed
+   * incrementally and the pivot is found in O(n) */
+  row_max = calloc(n, sizeof(int));
+  assert(row_max != NULL);
+  for (i = 0; i < n; ++i)
+    row_max[i] = RowMax(a, n, i);
+  while (n > 1 && num_iteration < 100 && convergence > nsc->epsilon) {
+    FindPivot(a, row_max, n, &(nsc->i_pivot), &(nsc->j_pivot));
+    pivot = a[PACKED_ROW(nsc->i_pivot, n) + nsc->j_pivot];
+    if (pivot == 0) /* A is diagonal */
       break;
-    }
-    CalculateRotationMatrix(a, p, n, nsc); /* p is the rotation matrix for a */
-    CalculateAPrimeEfficient(a, a_tag, nsc);
-    convergence = (Off(a, n) - Off(a_tag, n));
-    CopyMatrix(a, a_tag, n, n);
-    if (num_iteration > 0)
-      CopyMatrix(v, nsc->eigen_vectors, n, n);
-    MultiplyTwoMatrices(v, p, nsc->eigen_vectors, n);
+    CalculateRotation(a, n, nsc);
+    /* A = P^TAP and V = VP, touching only rows/columns i, j */
+    ApplyRotation(a, nsc);
+    RotateEigenVectors(nsc->eigen_vectors, nsc);
+    UpdateRowMax(a, row_max, n, nsc->i_pivot, nsc->j_pivot);
+    pivot_tag = a[PACKED_ROW(nsc->i_pivot, n) + nsc->j_pivot];
+    /* off(A) - off(A') = 2a_ij^2 - 2a'_ij^2, all other off diagonal mass
+     * is only moved around by the rotation */
+    convergence = 2 * (pivot * pivot - pivot_tag * pivot_tag);
     ++num_iteration;
   }
   /* Extract results */
   for (i = 0; i < nsc->n; ++i) {
-    nsc->eigen_values[i] = a[i * n + i];
+    nsc->eigen_values[i] = a[PACKED_ROW(i, n) + i];
   }
+  free(row_max);
+}
+int RowMax(const double a[], int n, int i) {
+  /* column of the first largest |a[i][j]| with j > i, -1 for the last row.
+   * the part of row i right of the diagonal is contiguous in packed a */
+  const double *row = a + PACKED_ROW(i, n);
+  int j, max_j = i + 1 < n ? i + 1 : -1;
+  for (j = i + 2; j < n; ++j)
+    if (fabs(row[j]) > fabs(row[max_j]))
+      max_j = j;
+  return max_j;
+}
+void UpdateRowMax(const double a[], int row_max[], int n, int i, int j) {
+  /* after a rotation of (i, j), i < j: rows i, j changed completely and
+   * every other row r changed at columns i, j only */
+  const double *row;
+  int r, m, col, k;
+  row_max[i] = RowMax(a, n, i);
+  row_max[j] = RowMax(a, n, j);
+  for (r = 0; r < j; ++r) {
+    if (r == i)
+      continue;
+    m = row_max[r];
+    if (m == i || m == j) { /* the old maximum may have shrunk */
+      row_max[r] = RowMax(a, n, r);
+      continue;
+    }
+    row = a + PACKED_ROW(r, n);
+    for (k = 0; k < 2; ++k) {
+      col = k == 0 ? i : j;
+      if (col <= r)
+        continue;
+      /* ties go to the smaller column, as in a full row scan */
+      if (fabs(row[col]) > fabs(row[m])
+          || (fabs(row[col]) == fabs(row[m]) && col < m))
+        m = col;
+    }
+    row_max[r] = m;
+  }
+}
+/****** Cyclic Jacobi
+ * Every sweep visits all (p,q) pairs in round-robin (tournament) order:
+ * n - 1 rounds (n rounded up to even), each made of n / 2 disjoint pairs.
+ * Rotations of disjoint pairs commute, so all rotations of a round are
+ * applied at once as A = J^TAJ, V = VJ with J the product of the round's
+ * rotations, and the work of a round is split between threads.*****/
+typedef struct {
+  double *a, *v;
+  int n, num_pairs;
+  int *p, *q; /* q[k] == -1 when p[k] is paired with the dummy index */
+  double *c, *s;
+  double threshold;
+} CyclicRound;
+
+static void CyclicRotations(void *args, int begin, int end) {
+  /* computes the rotation of every pair and applies it to its own 2x2
+   * diagonal block, which no other pair of the round touches */
+  CyclicRound *round = (CyclicRound *) args;
+  double *a = round->a, theta, t, c, s, a_pp, a_qq, a_pq;
+  int k, p, q, n = round->n;
+  for (k = begin; k < end; ++k) {
+    p = round->p[k];
+    q = round->q[k];
+    round->c[k] = 1;
+    round->s[k] = 0;
+    if (q == -1 || fabs(a[PACKED_ROW(p, n) + q]) <= round->threshold)
+      continue;
+    a_pp = a[PACKED_ROW(p, n) + p];
+    a_qq = a[PACKED_ROW(q, n) + q];
+    a_pq = a[PACKED_ROW(p, n) + q];
+    theta = (a_qq - a_pp) / (2 * a_pq);
+    t = Sign(theta) / (fabs(theta) + sqrt(theta * theta + 1));
+    c = 1 / (sqrt(t * t + 1));
+    s = t * c;
+    a[PACKED_ROW(p, n) + p] = c * c * a_pp + s * s * a_qq - 2 * s * c * a_pq;
+    a[PACKED_ROW(q, n) + q] = s * s * a_pp + c * c * a_qq + 2 * s * c * a_pq;
+    a[PACKED_ROW(p, n) + q] = 0;
+    round->c[k] = c;
+    round->s[k] = s;
+  }
+}
+
+static void CyclicRotateBlock(CyclicRound *round, int k, int l) {
+  /* off diagonal block of pairs k, l: B = R_k^T B R_l. the block and its
+   * mirror share their packed storage */
+  double *a = round->a, c_k = round->c[k], s_k = round->s[k],
+      c_l = round->c[l], s_l = round->s[l], b_pp, b_pq, b_qp, b_qq;
+  int n = round->n, p_k = round->p[k], q_k = round->q[k],
+      p_l = round->p[l], q_l = round->q[l];
+  size_t pp, pq, qp, qq;
+  if (s_k == 0 && s_l == 0)
+    return;
+  pp = PACKED_INDEX(p_k, p_l, n);
+  if (q_k == -1) { /* 1x2 block, only the column rotation applies */
+    pq = PACKED_INDEX(p_k, q_l, n);
+    b_pp = a[pp];
+    b_pq = a[pq];
+    a[pp] = c_l * b_pp - s_l * b_pq;
+    a[pq] = s_l * b_pp + c_l * b_pq;
+    return;
+  }
+  qp = PACKED_INDEX(q_k, p_l, n);
+  if (q_l == -1) { /* 2x1 block, only the row rotation applies */
+    b_pp = a[pp];
+    b_qp = a[qp];
+    a[pp] = c_k * b_pp - s_k * b_qp;
+    a[qp] = s_k * b_pp + c_k * b_qp;
+    return;
+  }
+  pq = PACKED_INDEX(p_k, q_l, n);
+  qq = PACKED_INDEX(q_k, q_l, n);
+  /* rows first (R_k^T B) then columns (B R_l) */
+  b_pp = c_k * a[pp] - s_k * a[qp];
+  b_pq = c_k * a[pq] - s_k * a[qq];
+  b_qp = s_k * a[pp] + c_k * a[qp];
+  b_qq = s_k * a[pq] + c_k * a[qq];
+  a[pp] = c_l * b_pp - s_l * b_pq;
+  a[pq] = s_l * b_pp + c_l * b_pq;
+  a[qp] = c_l * b_qp - s_l * b_qq;
+  a[qq] = s_l * b_qp + c_l * b_qq;
+}
+
+static void CyclicRotateBlocks(void *args, int begin, int end) {
+  /* item u owns the block rows of pairs u and num_pairs - 1 - u, so every
+   * item does about the same amount of work */
+  CyclicRound *round = (CyclicRound *) args;
+  int u, k, l, num_pairs = round->num_pairs;
+  for (u = begin; u < end; ++u) {
+    for (l = u + 1; l < num_pairs; ++l)
+      CyclicRotateBlock(round, u, l);
+    k = num_pairs - 1 - u;
+    if (k == u)
+      continue;
+    for (l = k + 1; l < num_pairs; ++l)
+      CyclicRotateBlock(round, k, l);
+  }
+}
+
+static void CyclicRotateEigenVectors(void *args, int begin, int end) {
+  /* V = VJ, row by row */
+  CyclicRound *round = (CyclicRound *) args;
+  double *v = round->v, v_rp, v_rq;
+  int r, k, p, q, n = round->n;
+  for (r = begin; r < end; ++r) {
+    for (k = 0; k < round->num_pairs; ++k) {
+      if (round->s[k] == 0)
+        continue;
+      p = round->p[k];
+      q = round->q[k];
+      v_rp = v[r * n + p];
+      v_rq = v[r * n + q];
+      v[r * n + p] = round->c[k] * v_rp - round->s[k] * v_rq;
+      v[r * n + q] = round->s[k] * v_rp + round->c[k] * v_rq;
+    }
+  }
+}
+
+void RunCyclicJacobiSweeps(double a[], int n, Nsc *nsc) {
+  CyclicRound round;
+  ThreadPool *pool = NscThreadPool(nsc);
+  int m = n + n % 2, sweep, r, k, x, y, i, *players;
+  double off, off_tag;
+  round.a = a;
+  round.v = nsc->eigen_vectors;
+  round.n = n;
+  round.num_pairs = m / 2;
+  round.p = calloc(m / 2, sizeof(int));
+  round.q = calloc(m / 2, sizeof(int));
+  round.c = calloc(m / 2, sizeof(double));
+  round.s = calloc(m / 2, sizeof(double));
+  players = calloc(m, sizeof(int));
+  assert(round.p != NULL && round.q != NULL && round.c != NULL
+             && round.s != NULL && players != NULL);
+  off = Off(a, n);
+  for (sweep = 0; sweep < 50 && off > 0; ++sweep) {
+    /* threshold Jacobi: the first sweeps skip elements that are small
+     * compared to the average off diagonal element */
+    round.threshold = sweep < 3 ? 0.2 * sqrt(off / ((double) n * (n - 1)))
+                                : 0;
+    for (i = 0; i < m; ++i)
+      players[i] = i;
+    for (r = 0; r < m - 1; ++r) {
+      for (k = 0; k < m / 2; ++k) {
+        x = players[k];
+        y = players[m - 1 - k];
+        if (x > y) {
+          i = x;
+          x = y;
+          y = i;
+        }
+        round.p[k] = x;
+        round.q[k] = y < n ? y : -1;
+      }
+      ParallelFor(pool, CyclicRotations, &round, m / 2);
+      ParallelFor(pool, CyclicRotateBlocks, &round, (m / 2 + 1) / 2);
+      ParallelFor(pool, CyclicRotateEigenVectors, &round, n);
+      /* round-robin: player 0 stays, the others rotate by one seat */
+      x = players[m - 1];
+      for (i = m - 1; i > 1; --i)
+        players[i] = players[i - 1];
+      players[1] = x;
+    }
+    off_tag = Off(a, n);
+    if (sweep >= 3 && off - off_tag <= nsc->epsilon) {
+      off = off_tag;
+      break;
+    }
+    off = off_tag;
+  }
+  /* Extract results */
+  for (i = 0; i < n; ++i)
+    nsc->eigen_values[i] = a[PACKED_ROW(i, n) + i];
+  free(round.p);
+  free(round.q);
+  free(round.c);
+  free(round.s);
+  free(players);
 }
 void FindPivot(const double a[],
+               const int row_max[],
                int n,
-               double *pivot,
                int *i_pivot,
                int *j_pivot) {
-  int i, j;
-  for (i = 0; i < n; ++i) {
-    for (j = i + 1; j < n; ++j) {
-      if (fabs(a[i * n + j]) > fabs(*pivot)) {
-        *pivot = a[i * n + j];
-        *i_pivot = i;
-        *j_pivot = j;
-      }
+  /* the first largest off diagonal |a[i][j]| (in row major order),
+   * using the row maxima */
+  int i;
+  double pivot = 0;
+  *i_pivot = 0;
+  *j_pivot = 1;
+  for (i = 0; i < n - 1; ++i) {
+    if (fabs(a[PACKED_ROW(i, n) + row_max[i]]) > pivot) {
+      pivot = fabs(a[PACKED_ROW(i, n) + row_max[i]]);
+      *i_pivot = i;
+      *j_pivot = row_max[i];
     }
   }
 }
@@ -288,223 +1408,1762 @@ int Sign(double theta) {
   return theta >= 0 ? 1 : -1;
 }
 double Off(double a[], int n) {
+  /* sum of squares of the off diagonal elements of packed a, the upper
+   * triangle counted twice */
   double off = 0.0;
+  const double *row;
   int i, j;
   for (i = 0; i < n; ++i) {
-    for (j = 0; j < n; ++j) {
-      if (i != j) {
-        off += pow(a[i * n + j], 2);
-      }
+    row = a + PACKED_ROW(i, n);
+    for (j = i + 1; j < n; ++j) {
+      off += row[j] * row[j];
     }
   }
-  return off;
+  return 2 * off;
 }
 void CopyMatrix(double a[], const double b[], int n, int d) {
+  memcpy(a, b, (size_t) n * d * sizeof(double));
+}
+void PackSymmetricMatrix(double packed[], const double full[], int n) {
   int i, j;
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < d; j++) {
-      a[i * d + j] = b[i * d + j];
-    }
-  }
+  for (i = 0; i < n; i++)
+    for (j = i; j < n; j++)
+      packed[PACKED_ROW(i, n) + j] = full[(size_t) i * n + j];
 }
-void ConstructNsc(Nsc *nsc, double *data_points, int n, int d, Goal goal) {
+void UnpackSymmetricMatrix(double full[], const double packed[], int n) {
+  int i, j;
+  for (i = 0; i < n; i++)
+    for (j = i; j < n; j++)
+      full[(size_t) i * n + j] = full[(size_t) j * n + i] =
+          packed[PACKED_ROW(i, n) + j];
+}
+void ConstructNsc(Nsc *nsc, const double *data_points, int n, int d,
+                  Goal goal) {
   nsc->epsilon = 0.00001;
   nsc->goal = goal;
+  nsc->eigen_solver = CLASSIC_JACOBI;
+  nsc->num_threads = 1;
+  nsc->pool = NULL;
   nsc->n = n;
   nsc->d = d;
-  AllocateMatrix(&(nsc->matrix), nsc->n, nsc->d);
-  CopyMatrix(nsc->matrix, data_points, n, d);
-  if (nsc->goal == JACOBI) {
-    AllocateMatrix(&(nsc->eigen_values), 1, n);
-    AllocateMatrix(&(nsc->eigen_vectors), n, n);
-    return;
-  }
-  AllocateMatrix(&(nsc->wam), nsc->n, nsc->n);
-  if (nsc->goal == WAM)
-    return;
-  AllocateMatrix(&(nsc->ddg), nsc->n, nsc->n);
-  if (nsc->goal == DDG)
-    return;
-  AllocateMatrix(&(nsc->inversed_sqrt_ddg), nsc->n, nsc->n);
-  AllocateMatrix(&(nsc->l_norm), nsc->n, nsc->n);
-  if (nsc->goal == LNORM)
-    return;
-  /* in case we called fit() from python we need to allocate
-   * memory for jacobi. */
-  AllocateMatrix(&(nsc->eigen_values), 1, n);
-  AllocateMatrix(&(nsc->eigen_vectors), n, n);
-
+  nsc->k = 0;
+  nsc->matrix = data_points;
+  /* every stage allocates its own output the first time it runs, the
+   * eigensolver through AllocateEigenpairs */
+  nsc->wam = NULL;
+  nsc->ddg = NULL;
+  nsc->inversed_sqrt_ddg = NULL;
+  nsc->l_norm = NULL;
+  nsc->graph = DENSE_GRAPH;
+  nsc->num_neighbours = 0;
+  nsc->cutoff = 0;
+  nsc->sparse_wam = NULL;
+  nsc->sparse_l_norm = NULL;
+  nsc->num_landmarks = 0;
+  nsc->landmark_sampling = UNIFORM_LANDMARKS;
+  nsc->stream_rows = 0;
+  nsc->eigen_values = NULL;
+  nsc->eigen_vectors = NULL;
+  nsc->num_eigen = 0;
+  nsc->valid_stages = 0;
+}
+void AllocateEigenpairs(Nsc *nsc, int m) {
+  /* room for m eigenvalues and the n x m matrix of their eigenvectors */
+  FreeMatrix(&(nsc->eigen_values));
+  FreeMatrix(&(nsc->eigen_vectors));
+  AllocateMatrix(&(nsc->eigen_values), 1, m);
+  AllocateMatrix(&(nsc->eigen_vectors), nsc->n, m);
+  nsc->num_eigen = m;
 }
 void DestructNsc(Nsc *nsc) {
-  FreeMatrix(&(nsc->matrix));
-  if (nsc->goal == JACOBI) {
-    FreeMatrix(&(nsc->eigen_values));
-    FreeMatrix(&(nsc->eigen_vectors));
-    return;
+  if (nsc->pool != NULL) {
+    DestroyThreadPool(nsc->pool);
+    nsc->pool = NULL;
   }
+  /* stages that never ran left their buffers NULL, the data points are
+   * the caller's */
+  nsc->matrix = NULL;
   FreeMatrix(&(nsc->wam));
-  if (nsc->goal == WAM)
-    return;
   FreeMatrix(&(nsc->ddg));
-  if (nsc->goal == DDG)
-    return;
   FreeMatrix(&(nsc->inversed_sqrt_ddg));
   FreeMatrix(&(nsc->l_norm));
-  if (nsc->goal == LNORM)
-    return;
-  /* in case we called fit() from python we need to de-allocate
-   * memory for jacobi. */
+  FreeSparseMatrix(&(nsc->sparse_wam));
+  FreeSparseMatrix(&(nsc->sparse_l_norm));
   FreeMatrix(&(nsc->eigen_values));
   FreeMatrix(&(nsc->eigen_vectors));
+  nsc->valid_stages = 0;
 }
 
-void CalculateNandD(const char file_name[], int *n, int *d) {
-  /* calculate number of input data data_points and dimensionality */
-  char c;
-  FILE *input_file = fopen(file_name, "r");
-  assert(input_file != NULL);
-  (*n) = 0, (*d) = 0;
-  while ((c = (char) fgetc(input_file)) != EOF) {
-    if (c == '\n') {
-      (*d) += 1;
-      break;
+/****** Input parsing
+ * LoadDataPoints maps the file and splits it into newline aligned chunks,
+ * the tasks of a pool. A first pass counts the lines and the non blank
+ * rows of every chunk, so every chunk knows where its rows go, and a
+ * second pass parses them. Numbers with at most 15 significant digits and
+ * a small exponent are m * 10^e or m / 10^-e of two exact doubles, which
+ * rounds once just like strtod; anything else goes to strtod, in the C
+ * locale of the CLI *****/
+#define PARSE_CHUNKS_PER_THREAD 4
+#define PARSE_MIN_CHUNK 65536
+#define MAX_FAST_DIGITS 15
+#define MAX_FAST_EXPONENT 22
+
+typedef struct {
+  const char *begin, *end;
+  int lines, rows; /* counted by the first pass */
+  int first_line, first_row;
+  int bad_line; /* the first malformed line, 0 if none */
+} ParseChunk;
+typedef struct {
+  ParseChunk *chunks;
+  int d;
+  double *data_points;
+} ParseJob;
+
+static int IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+static const char *LineEnd(const char *p, const char *end) {
+  const char *newline = memchr(p, '\n', (size_t) (end - p));
+  return newline == NULL ? end : newline;
+}
+static int IsBlankLine(const char *p, const char *end) {
+  for (; p < end; ++p)
+    if (!IsBlank(*p))
+      return 0;
+  return 1;
+}
+static int ParseDouble(const char *p, const char *end, double *value) {
+  /* the number in [p, end), blanks around it allowed. 0 if malformed */
+  static const double powers[MAX_FAST_EXPONENT + 1] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+      1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char *q;
+  char buffer[64], *copy, *parsed;
+  double mantissa = 0;
+  int negative = 0, digits = 0, significant = 0, exponent = 0, written = 0,
+      written_digits = 0, written_negative = 0, ok;
+  size_t length;
+  while (p < end && IsBlank(*p))
+    ++p;
+  while (end > p && IsBlank(end[-1]))
+    --end;
+  q = p;
+  if (q < end && (*q == '-' || *q == '+'))
+    negative = *q++ == '-';
+  for (; q < end && *q >= '0' && *q <= '9'; ++q, ++digits) {
+    significant += significant > 0 || *q != '0';
+    mantissa = mantissa * 10 + (*q - '0');
+  }
+  if (q < end && *q == '.')
+    for (++q; q < end && *q >= '0' && *q <= '9'; ++q, ++digits) {
+      significant += significant > 0 || *q != '0';
+      mantissa = mantissa * 10 + (*q - '0');
+      --exponent;
+    }
+  if (digits > 0 && q < end && (*q == 'e' || *q == 'E')) {
+    ++q;
+    if (q < end && (*q == '-' || *q == '+'))
+      written_negative = *q++ == '-';
+    for (; q < end && *q >= '0' && *q <= '9' && written_digits < 5;
+         ++q, ++written_digits)
+      written = written * 10 + (*q - '0');
+    exponent += written_negative ? -written : written;
+    if (written_digits == 0)
+      q = p; /* not a number strtod would take as a whole */
+  }
+  if (q == end && digits > 0 && significant <= MAX_FAST_DIGITS
+      && exponent >= -MAX_FAST_EXPONENT && exponent <= MAX_FAST_EXPONENT) {
+    /* the mantissa is exact, one rounding below */
+    if (exponent < 0)
+      mantissa /= powers[-exponent];
+    else
+      mantissa *= powers[exponent];
+    *value = negative ? -mantissa : mantissa;
+    return 1;
+  }
+  length = (size_t) (end - p);
+  if (length == 0)
+    return 0;
+  copy = length < sizeof(buffer) ? buffer : malloc(length + 1);
+  assert(copy != NULL);
+  memcpy(copy, p, length);
+  copy[length] = '\0';
+  *value = strtod(copy, &parsed);
+  ok = parsed == copy + length;
+  if (copy != buffer)
+    free(copy);
+  return ok;
+}
+static int ParseRow(const char *p, const char *end, int d, double row[]) {
+  /* the d comma separated numbers of the line [p, end), 0 if malformed */
+  const char *field_end;
+  int j;
+  for (j = 0; j < d; ++j) {
+    field_end = memchr(p, ',', (size_t) (end - p));
+    if (field_end == NULL)
+      field_end = end;
+    if ((field_end == end) != (j == d - 1)
+        || !ParseDouble(p, field_end, &row[j]))
+      return 0;
+    p = field_end + 1;
+  }
+  return 1;
+}
+static void CountRows(void *args, int begin, int end) {
+  ParseJob *job = (ParseJob *) args;
+  ParseChunk *chunk;
+  const char *p, *line_end;
+  int c;
+  for (c = begin; c < end; ++c) {
+    chunk = job->chunks + c;
+    chunk->lines = chunk->rows = 0;
+    for (p = chunk->begin; p < chunk->end; p = line_end + 1) {
+      line_end = LineEnd(p, chunk->end);
+      chunk->lines++;
+      chunk->rows += !IsBlankLine(p, line_end);
+    }
+  }
+}
+static void ParseRows(void *args, int begin, int end) {
+  ParseJob *job = (ParseJob *) args;
+  ParseChunk *chunk;
+  const char *p, *line_end;
+  int c, line, row;
+  for (c = begin; c < end; ++c) {
+    chunk = job->chunks + c;
+    chunk->bad_line = 0;
+    line = chunk->first_line;
+    row = chunk->first_row;
+    for (p = chunk->begin; p < chunk->end; p = line_end + 1, ++line) {
+      line_end = LineEnd(p, chunk->end);
+      if (IsBlankLine(p, line_end))
+        continue;
+      if (!ParseRow(p, line_end, job->d,
+                    job->data_points + (size_t) row++ * job->d)) {
+        chunk->bad_line = line;
+        break;
+      }
     }
-    if (c == ',')
-      (*d) += 1;
   }
-  rewind(input_file);
-  while ((c = (char) fgetc(input_file)) != EOF)
-    if (c == '\n')
-      (*n) += 1;
-  fclose(input_file);
 }
-void BuildDataPointsMatrix(const char file_name[],
-                           double *data_points) {
-  double data;
-  int i = 0;
-  FILE *input_file = fopen(file_name, "r");
-  assert(input_file != NULL);
-  while (fscanf(input_file, "%lf,", &data) != EOF) {
-    data_points[i] = data;
-    ++i;
+int LoadDataPoints(const char file_name[], int num_threads,
+                   double **data_points, int *n, int *d) {
+  int fd, c, num_chunks, lines = 1, rows = 0, bad_line = 0;
+  struct stat status;
+  const char *text, *end, *p, *line_end;
+  size_t size;
+  ParseJob job;
+  ThreadPool *pool;
+  fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot open\n", file_name);
+    return 0;
   }
+  if (fstat(fd, &status) != 0 || status.st_size == 0) {
+    fprintf(stderr, "%s: no data points\n", file_name);
+    close(fd);
+    return 0;
+  }
+  size = (size_t) status.st_size;
+  text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map\n", file_name);
+    return 0;
+  }
+  end = text + size;
+  /* d is the number of fields of the first row */
+  *d = 0;
+  for (p = text; p < end && *d == 0; p = line_end + 1) {
+    line_end = LineEnd(p, end);
+    if (!IsBlankLine(p, line_end))
+      for (*d = 1; p < line_end; ++p)
+        *d += *p == ',';
+  }
+  pool = CreateThreadPool(num_threads);
+  num_chunks = (int) (size / PARSE_MIN_CHUNK) + 1;
+  if (num_chunks > num_threads * PARSE_CHUNKS_PER_THREAD)
+    num_chunks = num_threads * PARSE_CHUNKS_PER_THREAD;
+  job.chunks = calloc(num_chunks, sizeof(ParseChunk));
+  assert(job.chunks != NULL);
+  job.d = *d;
+  /* chunk c starts after the first newline at or past c / num_chunks of
+   * the file */
+  for (c = 0; c < num_chunks; ++c) {
+    p = text + size / num_chunks * c;
+    if (c > 0) {
+      if (p < job.chunks[c - 1].begin)
+        p = job.chunks[c - 1].begin;
+      else if ((p = LineEnd(p - 1, end) + 1) > end)
+        p = end;
+      job.chunks[c - 1].end = p;
+    }
+    job.chunks[c].begin = p;
+  }
+  job.chunks[num_chunks - 1].end = end;
+  ParallelFor(pool, CountRows, &job, num_chunks);
+  for (c = 0; c < num_chunks; ++c) {
+    job.chunks[c].first_line = lines;
+    job.chunks[c].first_row = rows;
+    lines += job.chunks[c].lines;
+    rows += job.chunks[c].rows;
+  }
+  *n = rows;
+  *data_points = NULL;
+  if (rows > 0) {
+    AllocateMatrix(data_points, rows, *d);
+    job.data_points = *data_points;
+    ParallelFor(pool, ParseRows, &job, num_chunks);
+    for (c = 0; c < num_chunks && bad_line == 0; ++c)
+      bad_line = job.chunks[c].bad_line;
+  }
+  DestroyThreadPool(pool);
+  free(job.chunks);
+  munmap((void *) text, size);
+  if (rows == 0 || bad_line > 0) {
+    if (rows == 0)
+      fprintf(stderr, "%s: no data points\n", file_name);
+    else
+      fprintf(stderr, "%s:%d: expected %d comma separated numbers\n",
+              file_name, bad_line, *d);
+    FreeMatrix(data_points);
+    return 0;
+  }
+  return 1;
+}
+/****** Binary input
+ * The header is read byte by byte, so it does not depend on the byte
+ * order of the host. The values are used in place when they are float64
+ * and the host is little endian, otherwise they are converted into an
+ * owned copy *****/
+static unsigned long ReadLittleEndian(const unsigned char bytes[], int size) {
+  unsigned long value = 0;
+  while (size-- > 0)
+    value = value << 8 | bytes[size];
+  return value;
+}
+static int IsLittleEndian(void) {
+  const int one = 1;
+  return *(const char *) &one == 1;
+}
+static int HasBinaryMagic(const char file_name[]) {
+  char magic[sizeof(BINARY_MAGIC)];
+  FILE *input_file = fopen(file_name, "rb");
+  int found;
+  if (input_file == NULL)
+    return 0;
+  found = fread(magic, 1, sizeof(magic), input_file) == sizeof(magic)
+      && !memcmp(magic, BINARY_MAGIC, sizeof(magic));
   fclose(input_file);
+  return found;
+}
+static double ConvertValue(const unsigned char *bytes, BinaryType type) {
+  /* a little endian value of the file as a double of the host */
+  unsigned char host[sizeof(double)];
+  float single;
+  double value;
+  int size = type == BINARY_FLOAT64 ? 8 : 4, i;
+  for (i = 0; i < size; ++i)
+    host[i] = bytes[IsLittleEndian() ? i : size - 1 - i];
+  if (type == BINARY_FLOAT32) {
+    memcpy(&single, host, sizeof(float));
+    return single;
+  }
+  memcpy(&value, host, sizeof(double));
+  return value;
+}
+int MapDataPoints(const char file_name[], DataFile *file) {
+  const unsigned char *bytes;
+  unsigned long n, d, high_n, high_d;
+  BinaryType type;
+  size_t size, item_size, i;
+  struct stat status;
+  int fd = open(file_name, O_RDONLY);
+  memset(file, 0, sizeof(DataFile));
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot open\n", file_name);
+    return 0;
+  }
+  if (fstat(fd, &status) != 0 || status.st_size < BINARY_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a data points file\n", file_name);
+    close(fd);
+    return 0;
+  }
+  size = (size_t) status.st_size;
+  bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map\n", file_name);
+    return 0;
+  }
+  file->mapping = (void *) bytes;
+  file->mapping_size = size;
+  type = (BinaryType) ReadLittleEndian(bytes + 12, 4);
+  n = ReadLittleEndian(bytes + 16, 4);
+  high_n = ReadLittleEndian(bytes + 20, 4);
+  d = ReadLittleEndian(bytes + 24, 4);
+  high_d = ReadLittleEndian(bytes + 28, 4);
+  item_size = type == BINARY_FLOAT64 ? 8 : 4;
+  if (memcmp(bytes, BINARY_MAGIC, sizeof(BINARY_MAGIC))
+      || ReadLittleEndian(bytes + 8, 4) != BINARY_VERSION
+      || (type != BINARY_FLOAT64 && type != BINARY_FLOAT32)
+      || high_n != 0 || high_d != 0 || n < 1 || d < 1 || n > INT_MAX
+      || d > INT_MAX || n > (unsigned long) INT_MAX / d
+      || (size - BINARY_HEADER_SIZE) / item_size < n * d) {
+    fprintf(stderr, "%s: not a version %d data points file\n", file_name,
+            BINARY_VERSION);
+    CloseDataFile(file);
+    return 0;
+  }
+  file->n = (int) n;
+  file->d = (int) d;
+  if (type == BINARY_FLOAT64 && IsLittleEndian()) {
+    file->points = (const double *) (bytes + BINARY_HEADER_SIZE);
+    return 1;
+  }
+  AllocateMatrix(&file->owned, file->n, file->d);
+  for (i = 0; i < n * d; ++i)
+    file->owned[i] = ConvertValue(bytes + BINARY_HEADER_SIZE + i * item_size,
+                                  type);
+  file->points = file->owned;
+  munmap(file->mapping, size);
+  file->mapping = NULL;
+  return 1;
+}
+int OpenDataFile(const char file_name[], int num_threads, DataFile *file) {
+  if (HasBinaryMagic(file_name))
+    return MapDataPoints(file_name, file);
+  memset(file, 0, sizeof(DataFile));
+  if (!LoadDataPoints(file_name, num_threads, &file->owned, &file->n,
+                      &file->d))
+    return 0;
+  file->points = file->owned;
+  return 1;
+}
+void CloseDataFile(DataFile *file) {
+  if (file->mapping != NULL)
+    munmap(file->mapping, file->mapping_size);
+  FreeMatrix(&file->owned);
+  memset(file, 0, sizeof(DataFile));
 }
 double CalculateWeight(int i, int j, Nsc *nsc) {
-  /* i and j are the data data_points we want to find their weight */
-  int k;
-  double result;
-  double *vector_i, *vector_j;
-  vector_i = calloc(nsc->d, sizeof(double));
-  assert(vector_i != NULL);
-  vector_j = calloc(nsc->d, sizeof(double));
-  assert(vector_j != NULL);
-  for (k = 0; k < nsc->d; ++k) {
-    vector_i[k] =
-        (nsc->matrix)[i * nsc->d + k]; /* coping the ith row from matrix */
-    vector_j[k] =
-        (nsc->matrix)[j * nsc->d + k]; /* coping the jth row from matrix */
-  }
-  result = exp(-0.5 * CalculateEuclideanDistance(vector_i, vector_j, nsc->d));
-  free(vector_i);
-  free(vector_j);
-  return result;
-}
-
-void CalculateAPrimeEfficient(const double a[], double a_tag[], Nsc *nsc) {
+  /* i and j are the data data_points we want to find their weight.
+   * a single pair, CalculateWeightedAdjacencyMatrix uses the tiled kernel */
+  return exp(-0.5 * CalculateEuclideanDistance(
+      nsc->matrix + (size_t) i * nsc->d, nsc->matrix + (size_t) j * nsc->d,
+      nsc->d));
+}
+
+void ApplyRotation(double a[], Nsc *nsc) {
+  /* A = P^TAP in place. only rows and columns i, j of A change, on packed
+   * storage a_ri and a_ir are the same element */
   int i = nsc->i_pivot, j = nsc->j_pivot, n = nsc->n;
   double c = nsc->c, s = nsc->s;
+  double *a_i = a + PACKED_ROW(i, n), *a_j = a + PACKED_ROW(j, n);
+  double a_ii = a_i[i], a_jj = a_j[j], a_ij = a_i[j];
+  double a_ri, a_rj;
+  size_t ri, rj;
   int r;
   for (r = 0; r < n; ++r) {
-    if (r != nsc->i_pivot && r != nsc->j_pivot) {
-      a_tag[r * n + i] = c * a[r * n + i] - s * a[r * n + j];
-      a_tag[i * n + r] = a_tag[r * n + i];
-      a_tag[r * n + j] = c * a[r * n + j] + s * a[r * n + i];
-      a_tag[j * n + r] = a_tag[r * n + j];
+    if (r != i && r != j) {
+      ri = PACKED_INDEX(r, i, n);
+      rj = PACKED_INDEX(r, j, n);
+      a_ri = a[ri];
+      a_rj = a[rj];
+      a[ri] = c * a_ri - s * a_rj;
+      a[rj] = c * a_rj + s * a_ri;
     }
   }
-  a_tag[i * n + i] =
-      c * c * a[i * n + i] + s * s * a[j * n + j] - 2 * s * c * a[i * n + j];
-  a_tag[j * n + j] =
-      s * s * a[i * n + i] + c * c * a[j * n + j] + 2 * s * c * a[i * n + j];
-  a_tag[i * n + j] = ((c * c) - (s * s)) * a[i * n + j] + s * c * (a[i * n + i]
-      - a[j * n + j]);
-  a_tag[j * n + i] = a_tag[i * n + j];
+  a_i[i] = c * c * a_ii + s * s * a_jj - 2 * s * c * a_ij;
+  a_j[j] = s * s * a_ii + c * c * a_jj + 2 * s * c * a_ij;
+  a_i[j] = ((c * c) - (s * s)) * a_ij + s * c * (a_ii - a_jj);
+}
+void RotateEigenVectors(double v[], Nsc *nsc) {
+  /* V = VP in place. P differs from I only at (i,i), (i,j), (j,i), (j,j)
+   * so only columns i and j of V change */
+  int i = nsc->i_pivot, j = nsc->j_pivot, n = nsc->n;
+  double c = nsc->c, s = nsc->s;
+  double v_ri, v_rj;
+  int r;
+  for (r = 0; r < n; ++r) {
+    v_ri = v[r * n + i];
+    v_rj = v[r * n + j];
+    v[r * n + i] = c * v_ri - s * v_rj;
+    v[r * n + j] = s * v_ri + c * v_rj;
+  }
+}
+
+void Tridiagonalize(double z[], double d[], double e[], int n) {
+  /* Householder reduction of the symmetric z to tridiagonal form
+   * (EISPACK tred2). on return d is the diagonal, e[1..n-1] the sub
+   * diagonal and z the orthogonal matrix Q with z_in = Q T Q^T */
+  int i, j, k;
+  double scale, f, g, h, hh;
+  for (j = 0; j < n; ++j)
+    d[j] = z[(n - 1) * n + j];
+  for (i = n - 1; i > 0; --i) {
+    /* reflect row i onto its sub diagonal element */
+    scale = 0.0;
+    h = 0.0;
+    for (k = 0; k < i; ++k)
+      scale += fabs(d[k]);
+    if (scale == 0.0) {
+      e[i] = d[i - 1];
+      for (j = 0; j < i; ++j) {
+        d[j] = z[(i - 1) * n + j];
+        z[i * n + j] = 0.0;
+        z[j * n + i] = 0.0;
+      }
+    } else {
+      for (k = 0; k < i; ++k) {
+        d[k] /= scale;
+        h += d[k] * d[k];
+      }
+      f = d[i - 1];
+      g = sqrt(h);
+      if (f > 0)
+        g = -g;
+      e[i] = scale * g;
+      h = h - f * g;
+      d[i - 1] = f - g;
+      for (j = 0; j < i; ++j)
+        e[j] = 0.0;
+      /* e = A u / h */
+      for (j = 0; j < i; ++j) {
+        f = d[j];
+        z[j * n + i] = f;
+        g = e[j] + z[j * n + j] * f;
+        for (k = j + 1; k <= i - 1; ++k) {
+          g += z[k * n + j] * d[k];
+          e[k] += z[k * n + j] * f;
+        }
+        e[j] = g;
+      }
+      f = 0.0;
+      for (j = 0; j < i; ++j) {
+        e[j] /= h;
+        f += e[j] * d[j];
+      }
+      hh = f / (h + h);
+      for (j = 0; j < i; ++j)
+        e[j] -= hh * d[j];
+      /* A = A - u e^T - e u^T on the leading i x i block */
+      for (j = 0; j < i; ++j) {
+        f = d[j];
+        g = e[j];
+        for (k = j; k <= i - 1; ++k)
+          z[k * n + j] -= (f * e[k] + g * d[k]);
+        d[j] = z[(i - 1) * n + j];
+        z[i * n + j] = 0.0;
+      }
+    }
+    d[i] = h;
+  }
+  /* accumulate the reflections into Q */
+  for (i = 0; i < n - 1; ++i) {
+    z[(n - 1) * n + i] = z[i * n + i];
+    z[i * n + i] = 1.0;
+    h = d[i + 1];
+    if (h != 0.0) {
+      for (k = 0; k <= i; ++k)
+        d[k] = z[k * n + i + 1] / h;
+      for (j = 0; j <= i; ++j) {
+        g = 0.0;
+        for (k = 0; k <= i; ++k)
+          g += z[k * n + i + 1] * z[k * n + j];
+        for (k = 0; k <= i; ++k)
+          z[k * n + j] -= g * d[k];
+      }
+    }
+    for (k = 0; k <= i; ++k)
+      z[k * n + i + 1] = 0.0;
+  }
+  for (j = 0; j < n; ++j) {
+    d[j] = z[(n - 1) * n + j];
+    z[(n - 1) * n + j] = 0.0;
+  }
+  z[(n - 1) * n + n - 1] = 1.0;
+  e[0] = 0.0;
+}
+int TridiagonalQL(double d[], double e[], double z[], int n) {
+  /* implicit shift QL on the tridiagonal (d, e) from Tridiagonalize
+   * (EISPACK tql2). the rotations are accumulated into the columns of z,
+   * on return d holds the eigenvalues and z the eigenvectors (columns).
+   * returns 0 if some eigenvalue did not converge within 60 iterations */
+  int i, k, l, m, iteration, converged = 1;
+  double f = 0.0, tst1 = 0.0, eps = DBL_EPSILON;
+  double g, p, r, dl1, h, c, c2, c3, el1, s, s2;
+  for (i = 1; i < n; ++i)
+    e[i - 1] = e[i];
+  e[n - 1] = 0.0;
+  for (l = 0; l < n; ++l) {
+    /* find a negligible sub diagonal element to split T */
+    if (tst1 < fabs(d[l]) + fabs(e[l]))
+      tst1 = fabs(d[l]) + fabs(e[l]);
+    m = l;
+    while (m < n - 1 && fabs(e[m]) > eps * tst1)
+      ++m;
+    iteration = 0;
+    while (m > l && iteration < 60) {
+      ++iteration;
+      /* Wilkinson shift */
+      g = d[l];
+      p = (d[l + 1] - g) / (2.0 * e[l]);
+      r = Hypotenuse(p, 1.0);
+      if (p < 0)
+        r = -r;
+      d[l] = e[l] / (p + r);
+      d[l + 1] = e[l] * (p + r);
+      dl1 = d[l + 1];
+      h = g - d[l];
+      for (i = l + 2; i < n; ++i)
+        d[i] -= h;
+      f += h;
+      /* implicit QL transformation */
+      p = d[m];
+      c = 1.0;
+      c2 = c;
+      c3 = c;
+      el1 = e[l + 1];
+      s = 0.0;
+      s2 = 0.0;
+      for (i = m - 1; i >= l; --i) {
+        c3 = c2;
+        c2 = c;
+        s2 = s;
+        g = c * e[i];
+        h = c * p;
+        r = Hypotenuse(p, e[i]);
+        e[i + 1] = s * r;
+        s = e[i] / r;
+        c = p / r;
+        p = c * d[i] - s * g;
+        d[i + 1] = h + s * (c * g + s * d[i]);
+        for (k = 0; k < n; ++k) {
+          h = z[k * n + i + 1];
+          z[k * n + i + 1] = s * z[k * n + i] + c * h;
+          z[k * n + i] = c * z[k * n + i] - s * h;
+        }
+      }
+      p = -s * s2 * c3 * el1 * e[l] / dl1;
+      e[l] = s * p;
+      d[l] = c * p;
+      if (fabs(e[l]) <= eps * tst1)
+        break;
+    }
+    if (m > l && fabs(e[l]) > eps * tst1)
+      converged = 0;
+    d[l] = d[l] + f;
+    e[l] = 0.0;
+  }
+  return converged;
 }
 
 /****** The Eigen-gap Heuristic for finding number of clusters - K
- * values[n] , vectors[n * n], new_vectors[n * n]*****************/
+ * values[m] , vectors[n * m], new_vectors[n * m]
+ * m = nsc->num_eigen is n unless a partial eigensolver was used *****/
 int FindK(Nsc *nsc, int k) {
-  double *new_values, *new_vectors, minimum;
-  int i, j, index, max_index, n = nsc->n;
+  double *new_values, *new_vectors, bound;
+  int i, j, index, max_index = 0, n = nsc->n, m = nsc->num_eigen, last;
   double max = 0;
-  AllocateMatrix(&new_values, 1, n);
-  AllocateMatrix(&new_vectors, n, n);
-  minimum = FindMin(nsc->eigen_values, n);
-  for (i = 0; i < n; i++) {
-    index = IndexOfMaxValue(nsc->eigen_values, n);
+  AllocateMatrix(&new_values, 1, m);
+  AllocateMatrix(&new_vectors, n, m);
+  /* decreasing order. a partial eigensolver (Lanczos, Nystrom) has the
+   * largest eigenvalues only, so it finds the same gaps */
+  bound = FindMin(nsc->eigen_values, m) - 1;
+  for (i = 0; i < m; i++) {
+    index = IndexOfMaxValue(nsc->eigen_values, m);
     new_values[i] = nsc->eigen_values[index];
     for (j = 0; j < n; j++) {
-      new_vectors[j * n + i] = nsc->eigen_vectors[j * n + index];
+      new_vectors[j * m + i] = nsc->eigen_vectors[j * m + index];
     }
-    nsc->eigen_values[index] = minimum - 1;
+    nsc->eigen_values[index] = bound;
   }
   if (k == 0) {
-    for (i = 0; i < floor(n / 2.0); i++) {
+    /* like the first half of the n eigenvalues, only the first half of the
+     * m Nystrom Ritz values is searched. the rest approximate the spectrum
+     * poorly and the gaps between them are not real */
+    last = nsc->num_landmarks > 0 && nsc->goal != JACOBI ? m / 2 : m - 1;
+    for (i = 0; i < floor(n / 2.0) && i < last; i++) {
       if (max < fabs(new_values[i] - new_values[i + 1])) {
         max = fabs(new_values[i] - new_values[i + 1]);
         max_index = i;
       }
     }
   }
-  CopyMatrix(nsc->eigen_values, new_values, 1, n);
+  CopyMatrix(nsc->eigen_values, new_values, 1, m);
   FreeMatrix(&new_values);
-  CopyMatrix(nsc->eigen_vectors, new_vectors, n, n);
+  CopyMatrix(nsc->eigen_vectors, new_vectors, n, m);
   FreeMatrix(&new_vectors);
   if (k == 0)
     return max_index + 1;
   return k;
 }
+/****** Lanczos helpers *****/
+typedef struct {
+  const double *a, *x;
+  const SparseMatrix *sparse; /* replaces a in MultiplyRows if not NULL */
+  double *y;
+  int n;
+} Product;
+
+static void MultiplyRows(void *args, int begin, int end) {
+  /* y = a x for rows [begin, end) of the packed symmetric n x n matrix a.
+   * the left of row i is read down column i of the upper triangle */
+  Product *product = (Product *) args;
+  const SparseMatrix *sparse = product->sparse;
+  const double *a = product->a, *x = product->x, *row;
+  double sum;
+  size_t e;
+  int i, j, n = product->n;
+  for (i = begin; i < end; ++i) {
+    sum = 0;
+    if (sparse != NULL) {
+      for (e = sparse->row_start[i]; e < sparse->row_start[i + 1]; ++e)
+        sum += sparse->values[e] * x[sparse->columns[e]];
+      product->y[i] = sum;
+      continue;
+    }
+    for (j = 0; j < i; ++j)
+      sum += a[PACKED_ROW(j, n) + i] * x[j];
+    row = a + PACKED_ROW(i, n);
+    for (j = i; j < n; ++j)
+      sum += row[j] * x[j];
+    product->y[i] = sum;
+  }
+}
+static double Dot(const double x[], const double y[], int n) {
+  double sum = 0;
+  int i;
+  for (i = 0; i < n; ++i)
+    sum += x[i] * y[i];
+  return sum;
+}
+static double NextRandom(unsigned long *state) {
+  /* deterministic uniform in [-1, 1), the state is owned by the caller */
+  *state = (*state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+  return (double) *state / 1073741824.0 - 1.0;
+}
+static int Orthonormalize(double w[], const double q[], double h[], int j,
+                          int n) {
+  /* w = w - sum_i (q_i w) q_i for the first j basis vectors, twice for
+   * stability (CGS2). h receives the coefficients, w is normalized.
+   * returns 0 if w was (numerically) inside span(q) */
+  int pass, i, r;
+  double coefficient, norm_before = sqrt(Dot(w, w, n)), norm;
+  for (i = 0; i < j; ++i)
+    h[i] = 0;
+  for (pass = 0; pass < 2; ++pass) {
+    for (i = 0; i < j; ++i) {
+      coefficient = Dot(q + (size_t) i * n, w, n);
+      h[i] += coefficient;
+      for (r = 0; r < n; ++r)
+        w[r] -= coefficient * q[(size_t) i * n + r];
+    }
+  }
+  norm = sqrt(Dot(w, w, n));
+  h[j] = norm;
+  if (norm <= 1e-12 * norm_before || norm == 0)
+    return 0;
+  for (r = 0; r < n; ++r)
+    w[r] /= norm;
+  return 1;
+}
+void RunLanczos(Nsc *nsc, const double a[], const SparseMatrix *sparse,
+                int m) {
+  /* the m largest eigenpairs of a, sorted in decreasing order like the
+   * full eigensolvers leave them for FindK */
+  int n = nsc->n, p, keep, j, j0 = 0, i, l, r, restart, size, converged,
+      solved = 1, *order;
+  double *q, *h, *z, *y, *theta, *e, *coefficients, *scratch, *ritz,
+      beta = 0, residual;
+  unsigned long seed = 1;
+  Product product;
+  ThreadPool *pool = NscThreadPool(nsc);
+  /* Krylov basis size, larger bases converge in fewer restarts */
+  p = 2 * m + 20 < n ? 2 * m + 20 : n;
+  AllocateEigenpairs(nsc, m);
+  AllocateMatrix(&q, p + 1, n); /* basis vectors are rows */
+  AllocateMatrix(&h, p, p);
+  AllocateMatrix(&z, p, p);
+  AllocateMatrix(&y, p, p);
+  AllocateMatrix(&theta, 1, p);
+  AllocateMatrix(&e, 1, p);
+  AllocateMatrix(&coefficients, 1, p + 1);
+  AllocateMatrix(&scratch, 1, p + 1);
+  AllocateMatrix(&ritz, p, n);
+  order = calloc(p, sizeof(int));
+  assert(order != NULL);
+  product.a = a;
+  product.sparse = sparse;
+  product.n = n;
+  for (r = 0; r < n; ++r)
+    q[r] = 1.0 + 0.5 * NextRandom(&seed);
+  Orthonormalize(q, q, coefficients, 0, n);
+  for (restart = 0; restart < 100; ++restart) {
+    /* (a) extend the basis up to p vectors */
+    size = p;
+    for (j = j0; j < p; ++j) {
+      product.x = q + (size_t) j * n;
+      product.y = q + (size_t) (j + 1) * n;
+      ParallelFor(pool, MultiplyRows, &product, n);
+      if (!Orthonormalize(q + (size_t) (j + 1) * n, q, coefficients, j + 1,
+                          n)) {
+        coefficients[j + 1] = 0;
+        if (j + 1 == n) { /* the basis spans everything */
+          size = j + 1;
+        } else { /* invariant subspace, continue with a fresh direction */
+          for (r = 0; r < n; ++r)
+            q[(size_t) (j + 1) * n + r] = NextRandom(&seed);
+          Orthonormalize(q + (size_t) (j + 1) * n, q, scratch, j + 1, n);
+        }
+      }
+      for (i = 0; i <= j; ++i) {
+        h[i * p + j] = coefficients[i];
+        h[j * p + i] = coefficients[i];
+      }
+      beta = coefficients[j + 1];
+      if (j + 1 < p)
+        h[(j + 1) * p + j] = h[j * p + j + 1] = beta;
+      if (size == j + 1)
+        break;
+    }
+    /* (b) Ritz pairs: eigenpairs of the size x size block of H */
+    for (i = 0; i < size; ++i)
+      for (l = 0; l < size; ++l)
+        z[i * size + l] = h[i * p + l];
+    Tridiagonalize(z, theta, e, size);
+    if (!TridiagonalQL(theta, e, z, size)) {
+      solved = 0;
+      break;
+    }
+    for (i = 0; i < size; ++i)
+      order[i] = i;
+    for (i = 1; i < size; ++i) { /* insertion sort, decreasing theta */
+      l = order[i];
+      for (r = i; r > 0 && theta[order[r - 1]] < theta[l]; --r)
+        order[r] = order[r - 1];
+      order[r] = l;
+    }
+    converged = 1;
+    for (i = 0; i < m; ++i) {
+      residual = fabs(beta * z[(size - 1) * size + order[i]]);
+      if (residual > nsc->epsilon * (fabs(theta[order[i]]) > 1
+                                     ? fabs(theta[order[i]]) : 1))
+        converged = 0;
+    }
+    /* keep the wanted Ritz vectors and half of the others */
+    keep = converged ? m : m + (size - m) / 2;
+    /* ritz = Y^T Q for the best keep Ritz vectors */
+    for (i = 0; i < size; ++i)
+      for (l = 0; l < keep; ++l)
+        y[i * keep + l] = z[i * size + order[l]];
+    Gemm(pool, TRANSPOSE, NO_TRANSPOSE, keep, n, size, 1, y, keep, q, n, 0,
+         ritz, n);
+    if (converged)
+      break;
+    /* (c) thick restart: kept Ritz vectors, then the residual direction */
+    for (l = 0; l < keep; ++l)
+      for (r = 0; r < n; ++r)
+        q[(size_t) l * n + r] = ritz[(size_t) l * n + r];
+    for (r = 0; r < n; ++r)
+      q[(size_t) keep * n + r] = q[(size_t) size * n + r];
+    for (i = 0; i < p; ++i)
+      for (l = 0; l < p; ++l)
+        h[i * p + l] = 0;
+    for (l = 0; l < keep; ++l)
+      h[l * p + l] = theta[order[l]];
+    j0 = keep;
+  }
+  /* no convergence within 100 restarts is a failure, like in TridiagonalQL */
+  if (restart == 100)
+    solved = 0;
+  /* Extract results, eigenvectors are the columns */
+  for (l = 0; solved && l < m; ++l) {
+    nsc->eigen_values[l] = theta[order[l]];
+    for (r = 0; r < n; ++r)
+      nsc->eigen_vectors[r * m + l] = ritz[(size_t) l * n + r];
+  }
+  if (!solved)
+    nsc->num_eigen = 0;
+  FreeMatrix(&q);
+  FreeMatrix(&h);
+  FreeMatrix(&z);
+  FreeMatrix(&y);
+  FreeMatrix(&theta);
+  FreeMatrix(&e);
+  FreeMatrix(&coefficients);
+  FreeMatrix(&scratch);
+  FreeMatrix(&ritz);
+  free(order);
+}
+/****** Nystrom approximation
+ * With m landmark points L, the kernel K (the WAM with w(x, x) = 1, which
+ * unlike the WAM is positive semidefinite) is approximated by C A^+ C^T
+ * with C = K(X, L) (n x m) and A = K(L, L) (m x m), and W = K - I, so
+ * neither the n x n affinity nor l_norm is formed. With the degrees D of
+ * that W and G = D^-1/2 C A^+1/2 the normalized affinity is
+ * G G^T - D^-1. G^T G = R S R^T gives the orthonormal basis
+ * Q = G R S^-1/2 of the range of G, and the eigenpairs of l_norm are
+ * approximated there (Rayleigh-Ritz): with S - Q^T D^-1 Q = P T P^T they
+ * are Q P and 1 - T. Both steps are exact once every point is a
+ * landmark *****/
+typedef struct {
+  const Nsc *nsc;
+  const int *landmarks;
+  double *c;
+  int m;
+} LandmarkAffinity;
+
+static void LandmarkAffinityRows(void *args, int begin, int end) {
+  /* c[i][l] = w(x_i, x_L_l) for rows [begin, end), the weight of
+   * CalculateWeight */
+  LandmarkAffinity *affinity = (LandmarkAffinity *) args;
+  const Nsc *nsc = affinity->nsc;
+  int i, l, m = affinity->m, d = nsc->d;
+  for (i = begin; i < end; ++i)
+    for (l = 0; l < m; ++l)
+      affinity->c[(size_t) i * m + l] = exp(-0.5 * CalculateEuclideanDistance(
+          nsc->matrix + (size_t) i * d,
+          nsc->matrix + (size_t) affinity->landmarks[l] * d, d));
+}
+
+static void ChooseLandmarks(const Nsc *nsc, int landmarks[], int m) {
+  /* m distinct points, uniformly or by k-means++ (D^2) sampling. the
+   * generator is seeded the same way on every run */
+  unsigned long seed = 1;
+  double *nearest, total, target, squared;
+  int *order, i, l, t, n = nsc->n, d = nsc->d;
+  if (nsc->landmark_sampling == UNIFORM_LANDMARKS) {
+    /* the first m entries of a partial Fisher-Yates shuffle */
+    order = calloc((size_t) n, sizeof(int));
+    assert(order != NULL);
+    for (i = 0; i < n; ++i)
+      order[i] = i;
+    for (l = 0; l < m; ++l) {
+      i = l + (int) ((NextRandom(&seed) + 1) / 2 * (n - l));
+      i = i < n ? i : n - 1;
+      t = order[l];
+      order[l] = order[i];
+      order[i] = t;
+      landmarks[l] = order[l];
+    }
+    free(order);
+    return;
+  }
+  /* nearest[i]: squared distance to the closest landmark, -1 for the
+   * landmarks themselves */
+  AllocateMatrix(&nearest, 1, n);
+  t = (int) ((NextRandom(&seed) + 1) / 2 * n);
+  t = t < n ? t : n - 1;
+  for (i = 0; i < n; ++i)
+    nearest[i] = SquaredDistance(nsc->matrix + (size_t) i * d,
+                                 nsc->matrix + (size_t) t * d, d);
+  for (l = 0;;) {
+    landmarks[l] = t;
+    nearest[t] = -1;
+    if (++l == m)
+      break;
+    total = 0;
+    for (i = 0; i < n; ++i)
+      total += nearest[i] > 0 ? nearest[i] : 0;
+    target = (NextRandom(&seed) + 1) / 2 * total;
+    for (i = 0, t = -1; i < n; ++i) {
+      if (nearest[i] > 0)
+        t = i;
+      if (nearest[i] > 0 && (target -= nearest[i]) < 0)
+        break;
+    }
+    /* every point left coincides with a landmark, take the first */
+    for (i = 0; t == -1; ++i)
+      if (nearest[i] == 0)
+        t = i;
+    for (i = 0; i < n; ++i) {
+      squared = SquaredDistance(nsc->matrix + (size_t) i * d,
+                                nsc->matrix + (size_t) t * d, d);
+      if (nearest[i] >= 0 && squared < nearest[i])
+        nearest[i] = squared;
+    }
+  }
+  FreeMatrix(&nearest);
+}
+
+static int InverseSquareRoot(double a[], double values[], double e[],
+                             double scratch[], int m) {
+  /* a = a^+1/2 in place for the symmetric m x m a: eigenvalues below a
+   * relative tolerance count as 0. returns 0 if the eigensolver failed */
+  int i, l;
+  double tolerance = 0;
+  Tridiagonalize(a, values, e, m);
+  if (!TridiagonalQL(values, e, a, m))
+    return 0;
+  for (l = 0; l < m; ++l)
+    tolerance = fabs(values[l]) > tolerance ? fabs(values[l]) : tolerance;
+  tolerance *= m * DBL_EPSILON;
+  for (l = 0; l < m; ++l)
+    values[l] = values[l] > tolerance ? 1 / sqrt(values[l]) : 0;
+  /* E diag(values) E^T = F F^T with F = E diag(values)^1/2 */
+  for (i = 0; i < m; ++i)
+    for (l = 0; l < m; ++l)
+      scratch[i * m + l] = a[i * m + l] * sqrt(values[l]);
+  Gemm(NULL, NO_TRANSPOSE, TRANSPOSE, m, m, m, 1, scratch, m, scratch, m, 0,
+       a, m);
+  return 1;
+}
+
+void CalculateNystrom(Nsc *nsc) {
+  LandmarkAffinity affinity;
+  ThreadPool *pool = NscThreadPool(nsc);
+  int n = nsc->n, m, i, l, pass, solved, rank, *landmarks;
+  double *c, *g, *core, *values, *e, *scratch, *sums, *t, *scale, degree,
+      tolerance = 0;
+  m = nsc->num_landmarks > nsc->k ? nsc->num_landmarks : nsc->k;
+  m = m < n ? m : n;
+  landmarks = calloc((size_t) m, sizeof(int));
+  assert(landmarks != NULL);
+  ChooseLandmarks(nsc, landmarks, m);
+  AllocateMatrix(&c, n, m);
+  AllocateMatrix(&g, n, m);
+  AllocateMatrix(&core, m, m);
+  AllocateMatrix(&scratch, m, m);
+  AllocateMatrix(&values, 1, m);
+  AllocateMatrix(&e, 1, m);
+  AllocateMatrix(&sums, 1, m);
+  AllocateMatrix(&t, 1, m);
+  AllocateMatrix(&scale, 1, n);
+  affinity.nsc = nsc;
+  affinity.landmarks = landmarks;
+  affinity.c = c;
+  affinity.m = m;
+  ParallelFor(pool, LandmarkAffinityRows, &affinity, n);
+  /* A^+1/2, A is made of the landmark rows of C */
+  for (l = 0; l < m; ++l)
+    for (i = 0; i < m; ++i)
+      core[l * m + i] = c[(size_t) landmarks[l] * m + i];
+  solved = InverseSquareRoot(core, values, e, scratch, m);
+  /* degrees C A^+ C^T 1 - 1 = C (A^+1/2 (A^+1/2 (C^T 1))) - 1, then
+   * C = D^-1/2 C */
+  for (i = 0; i < n; ++i)
+    for (l = 0; l < m; ++l)
+      sums[l] += c[(size_t) i * m + l];
+  for (pass = 0; pass < 2; ++pass) {
+    for (l = 0; l < m; ++l) {
+      t[l] = 0;
+      for (i = 0; i < m; ++i)
+        t[l] += core[l * m + i] * sums[i];
+    }
+    CopyMatrix(sums, t, 1, m);
+  }
+  for (i = 0; i < n; ++i) {
+    degree = 0;
+    for (l = 0; l < m; ++l)
+      degree += c[(size_t) i * m + l] * sums[l];
+    scale[i] = degree > 1 ? 1 / sqrt(degree - 1) : 0;
+    for (l = 0; l < m; ++l)
+      c[(size_t) i * m + l] *= scale[i];
+  }
+  /* G = C A^+1/2, G^T G = R S R^T */
+  Gemm(pool, NO_TRANSPOSE, NO_TRANSPOSE, n, m, m, 1, c, m, core, m, 0, g, m);
+  Gemm(pool, TRANSPOSE, NO_TRANSPOSE, m, m, n, 1, g, m, g, m, 0, core, m);
+  Tridiagonalize(core, values, e, m);
+  if (!TridiagonalQL(values, e, core, m))
+    solved = 0;
+  /* Q = G R S^-1/2 into c. the directions with S ~ 0 are left out, so Q
+   * has rank columns: as zero columns they would come out as Ritz values
+   * of exactly 1 and a gap the eigengap heuristic picks. Q is padded with
+   * zero columns up to k, for U */
+  for (l = 0; l < m; ++l)
+    tolerance = fabs(values[l]) > tolerance ? fabs(values[l]) : tolerance;
+  tolerance *= m * DBL_EPSILON;
+  rank = 0;
+  for (l = 0; l < m; ++l) {
+    if (values[l] <= tolerance)
+      continue;
+    degree = 1 / sqrt(values[l]);
+    for (i = 0; i < m; ++i)
+      core[i * m + rank] = core[i * m + l] * degree;
+    values[rank++] = values[l];
+  }
+  for (; rank < nsc->k || rank == 0; ++rank) {
+    for (i = 0; i < m; ++i)
+      core[i * m + rank] = 0;
+    values[rank] = 0;
+  }
+  Gemm(pool, NO_TRANSPOSE, NO_TRANSPOSE, n, rank, m, 1, g, m, core, m, 0, c,
+       rank);
+  /* S - Q^T D^-1 Q, with D^-1/2 Q in g */
+  for (i = 0; i < n; ++i)
+    for (l = 0; l < rank; ++l)
+      g[(size_t) i * rank + l] = c[(size_t) i * rank + l] * scale[i];
+  Gemm(pool, TRANSPOSE, NO_TRANSPOSE, rank, rank, n, 1, g, rank, g, rank, 0,
+       core, rank);
+  for (l = 0; l < rank * rank; ++l)
+    core[l] = -core[l];
+  for (l = 0; l < rank; ++l)
+    core[l * rank + l] += values[l];
+  Tridiagonalize(core, values, e, rank);
+  if (!TridiagonalQL(values, e, core, rank))
+    solved = 0;
+  AllocateEigenpairs(nsc, rank);
+  for (l = 0; l < rank; ++l)
+    nsc->eigen_values[l] = 1 - values[l];
+  Gemm(pool, NO_TRANSPOSE, NO_TRANSPOSE, n, rank, rank, 1, c, rank, core,
+       rank, 0, nsc->eigen_vectors, rank);
+  if (!solved)
+    nsc->num_eigen = 0;
+  free(landmarks);
+  FreeMatrix(&c);
+  FreeMatrix(&g);
+  FreeMatrix(&core);
+  FreeMatrix(&scratch);
+  FreeMatrix(&values);
+  FreeMatrix(&e);
+  FreeMatrix(&sums);
+  FreeMatrix(&t);
+  FreeMatrix(&scale);
+}
+/*
+ * Parallel helpers
+ */
+
+/* A fixed set of worker threads. ParallelFor splits [0, count) into
+ * num_threads contiguous chunks, the calling thread runs the first one. */
+struct thread_pool {
+  pthread_t *threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t start, done;
+  int num_threads, generation, pending, stop;
+  ParallelTask task;
+  void *args;
+  int count;
+};
+typedef struct {
+  ThreadPool *pool;
+  int id;
+} Worker;
+
+static void *WorkerLoop(void *arg) {
+  Worker *worker = (Worker *) arg;
+  ThreadPool *pool = worker->pool;
+  int id = worker->id, generation = 0, begin, end;
+  free(worker);
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->generation == generation && !pool->stop)
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+    begin = (int) ((double) pool->count * id / pool->num_threads);
+    end = (int) ((double) pool->count * (id + 1) / pool->num_threads);
+    if (begin < end)
+      pool->task(pool->args, begin, end);
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+ThreadPool *CreateThreadPool(int num_threads) {
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  Worker *worker;
+  int i;
+  assert(pool != NULL);
+  pool->num_threads = num_threads < 1 ? 1 : num_threads;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->threads = calloc(pool->num_threads, sizeof(pthread_t));
+  assert(pool->threads != NULL);
+  for (i = 1; i < pool->num_threads; ++i) {
+    worker = malloc(sizeof(Worker));
+    assert(worker != NULL);
+    worker->pool = pool;
+    worker->id = i;
+    if (pthread_create(&pool->threads[i], NULL, WorkerLoop, worker) != 0) {
+      /* run with the threads we got */
+      free(worker);
+      pool->num_threads = i;
+      break;
+    }
+  }
+  return pool;
+}
+void DestroyThreadPool(ThreadPool *pool) {
+  int i;
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (i = 1; i < pool->num_threads; ++i)
+    pthread_join(pool->threads[i], NULL);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool);
+}
+void ParallelFor(ThreadPool *pool, ParallelTask task, void *args, int count) {
+  int end;
+  if (count <= 0)
+    return;
+  if (pool->num_threads == 1 || count == 1) {
+    task(args, 0, count);
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->task = task;
+  pool->args = args;
+  pool->count = count;
+  pool->pending = pool->num_threads - 1;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  end = (int) ((double) count / pool->num_threads);
+  if (end > 0)
+    task(args, 0, end);
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+ThreadPool *NscThreadPool(Nsc *nsc) {
+  /* the pool is created on first use, sized by nsc->num_threads */
+  if (nsc->pool == NULL)
+    nsc->pool = CreateThreadPool(nsc->num_threads);
+  return nsc->pool;
+}
+
+/****** Output
+ * Matrices are written in blocks of rows, a block formatted by a task of
+ * the pool into its own buffer and the buffers written in order with
+ * write(), a round of one block per thread at a time. FormatFixed4 writes
+ * what printf("%.4f") would: |x| * 10^4 rounds the same way unless it is
+ * within its own rounding error of a half, and those values, like the
+ * very large or not finite ones, are left to sprintf *****/
+#define WRITE_BLOCK_BYTES 1048576
+#define FAST_FORMAT_LIMIT 1e9
+#define MAX_FORMATTED_LENGTH 320 /* -DBL_MAX with 4 decimals, and more */
+
+typedef void (*RowReader)(const void *matrix, int i, int cols, double row[]);
+typedef struct {
+  RowReader read_row;
+  const void *matrix;
+  int rows, cols, first_row, rows_per_block;
+  char **buffers;
+  size_t *lengths, *capacities;
+} WriteJob;
+
+static int FormatFixed4(double x, char out[]) {
+  /* x as printf("%.4f", x) writes it, returns the length */
+  char digits[16];
+  double t, whole, fraction, rounded, integer_part, decimals;
+  unsigned long integer, fixed;
+  int length = 0, count = 0, negative = x < 0 || (x == 0 && 1 / x < 0);
+  t = (negative ? -x : x) * 1e4;
+  if (!(t < FAST_FORMAT_LIMIT * 1e4))
+    return sprintf(out, "%.4f", x);
+  whole = floor(t);
+  fraction = t - whole;
+  if (fabs(fraction - 0.5) <= t * DBL_EPSILON)
+    return sprintf(out, "%.4f", x);
+  rounded = whole + (fraction > 0.5);
+  integer_part = floor(rounded / 1e4);
+  decimals = rounded - integer_part * 1e4;
+  if (decimals < 0) {
+    integer_part -= 1;
+    decimals += 1e4;
+  } else if (decimals >= 1e4) {
+    integer_part += 1;
+    decimals -= 1e4;
+  }
+  if (negative)
+    out[length++] = '-';
+  integer = (unsigned long) integer_part;
+  do {
+    digits[count++] = (char) ('0' + integer % 10);
+    integer /= 10;
+  } while (integer > 0);
+  while (count > 0)
+    out[length++] = digits[--count];
+  out[length++] = '.';
+  fixed = (unsigned long) decimals;
+  out[length++] = (char) ('0' + fixed / 1000);
+  out[length++] = (char) ('0' + fixed / 100 % 10);
+  out[length++] = (char) ('0' + fixed / 10 % 10);
+  out[length++] = (char) ('0' + fixed % 10);
+  return length;
+}
+static void FormatRows(void *args, int begin, int end) {
+  WriteJob *job = (WriteJob *) args;
+  double *row = malloc(((size_t) job->cols + 1) * sizeof(double));
+  char **buffer;
+  size_t *length, *capacity;
+  int b, i, j, last;
+  assert(row != NULL);
+  for (b = begin; b < end; ++b) {
+    buffer = job->buffers + b;
+    length = job->lengths + b;
+    capacity = job->capacities + b;
+    *length = 0;
+    i = job->first_row + b * job->rows_per_block;
+    last = i + job->rows_per_block < job->rows ? i + job->rows_per_block
+                                               : job->rows;
+    for (; i < last; ++i) {
+      job->read_row(job->matrix, i, job->cols, row);
+      for (j = 0; j < job->cols; ++j) {
+        if (*length + MAX_FORMATTED_LENGTH + 2 > *capacity) {
+          *capacity = 2 * *capacity + MAX_FORMATTED_LENGTH + 2;
+          *buffer = realloc(*buffer, *capacity);
+          assert(*buffer != NULL);
+        }
+        *length += FormatFixed4(row[j], *buffer + *length);
+        (*buffer)[(*length)++] = j != job->cols - 1 ? ',' : '\n';
+      }
+    }
+  }
+  free(row);
+}
+static void WriteAll(const char *data, size_t length) {
+  ssize_t written;
+  while (length > 0) {
+    written = write(STDOUT_FILENO, data, length);
+    if (written <= 0)
+      return;
+    data += written;
+    length -= (size_t) written;
+  }
+}
+static void WriteMatrix(ThreadPool *pool, RowReader read_row,
+                        const void *matrix, int rows, int cols) {
+  /* prints read_row's rows x cols matrix, rows in parallel if pool */
+  WriteJob job;
+  int slots = pool == NULL ? 1 : pool->num_threads, count, b;
+  job.read_row = read_row;
+  job.matrix = matrix;
+  job.rows = rows;
+  job.cols = cols;
+  job.rows_per_block = WRITE_BLOCK_BYTES / 8 / (cols > 0 ? cols : 1);
+  if (job.rows_per_block < 1)
+    job.rows_per_block = 1;
+  job.buffers = calloc(slots, sizeof(char *));
+  job.lengths = calloc(slots, sizeof(size_t));
+  job.capacities = calloc(slots, sizeof(size_t));
+  assert(job.buffers != NULL && job.lengths != NULL
+             && job.capacities != NULL);
+  /* anything printf()ed before goes first */
+  fflush(stdout);
+  for (job.first_row = 0; job.first_row < rows;
+       job.first_row += slots * job.rows_per_block) {
+    count = (rows - job.first_row + job.rows_per_block - 1)
+        / job.rows_per_block;
+    if (count > slots)
+      count = slots;
+    if (pool == NULL)
+      FormatRows(&job, 0, count);
+    else
+      ParallelFor(pool, FormatRows, &job, count);
+    for (b = 0; b < count; ++b)
+      WriteAll(job.buffers[b], job.lengths[b]);
+  }
+  for (b = 0; b < slots; ++b)
+    free(job.buffers[b]);
+  free(job.buffers);
+  free(job.lengths);
+  free(job.capacities);
+}
+static void ReadDenseRow(const void *matrix, int i, int cols, double row[]) {
+  memcpy(row, (const double *) matrix + (size_t) i * cols,
+         (size_t) cols * sizeof(double));
+}
+static void ReadSymmetricRow(const void *matrix, int i, int cols,
+                             double row[]) {
+  const double *packed = (const double *) matrix;
+  int j;
+  for (j = 0; j < i; ++j)
+    row[j] = packed[PACKED_ROW(j, cols) + i];
+  memcpy(row + i, packed + PACKED_ROW(i, cols) + i,
+         (size_t) (cols - i) * sizeof(double));
+}
+static void ReadDiagonalRow(const void *matrix, int i, int cols,
+                            double row[]) {
+  int j;
+  for (j = 0; j < cols; ++j)
+    row[j] = 0.0;
+  row[i] = ((const double *) matrix)[i];
+}
+static void ReadSparseRow(const void *matrix, int i, int cols,
+                          double row[]) {
+  const SparseMatrix *sparse = (const SparseMatrix *) matrix;
+  size_t entry;
+  int j;
+  for (j = 0; j < cols; ++j)
+    row[j] = 0.0;
+  for (entry = sparse->row_start[i]; entry < sparse->row_start[i + 1];
+       ++entry)
+    row[sparse->columns[entry]] = sparse->values[entry];
+}
+void PrintMatrix(ThreadPool *pool, const double *matrix, int n, int d) {
+  WriteMatrix(pool, ReadDenseRow, matrix, n, d);
+}
+void PrintSymmetricMatrix(ThreadPool *pool, const double *packed, int n) {
+  WriteMatrix(pool, ReadSymmetricRow, packed, n, n);
+}
+void PrintDiagonalMatrix(ThreadPool *pool, const double *diagonal, int n) {
+  WriteMatrix(pool, ReadDiagonalRow, diagonal, n, n);
+}
+void PrintSparseMatrix(ThreadPool *pool, const SparseMatrix *matrix) {
+  WriteMatrix(pool, ReadSparseRow, matrix, matrix->n, matrix->n);
+}
+
+/****** Streaming output
+ * With nsc->stream_rows > 0 the dense wam, ddg and lnorm goals never hold
+ * an n x n matrix: the weights of stream_rows rows at a time are computed
+ * tile by tile into a stream_rows x n block, which is printed (wam) or
+ * summed into the degrees (ddg, and the first pass of lnorm) or turned into
+ * rows of the Laplacian by the degrees of the first pass. Every value is
+ * computed with the same operations as in the packed matrices, a w_ij
+ * below the diagonal as w_ji, so the output is the same byte for byte *****/
+typedef struct {
+  const Nsc *nsc;
+  const double *norms;
+  const double *scale; /* D^-1/2 to print the Laplacian, else NULL */
+  int first_row, rows, column_tiles;
+  int block_rows; /* stream_rows, at most n */
+  double *block; /* block_rows x n */
+  double *degrees;
+} StreamBlock;
+
+static void StreamTiles(void *args, int begin, int end) {
+  /* tiles [begin, end) of the block, row tile by row tile */
+  StreamBlock *stream = (StreamBlock *) args;
+  const double *scale = stream->scale;
+  double *dots, *row;
+  int t, i, j, i0, i1, j0, j1, n = stream->nsc->n,
+      last = stream->first_row + stream->rows;
+  AllocateMatrix(&dots, WEIGHT_TILE, WEIGHT_TILE);
+  for (t = begin; t < end; ++t) {
+    i0 = stream->first_row + t / stream->column_tiles * WEIGHT_TILE;
+    j0 = t % stream->column_tiles * WEIGHT_TILE;
+    i1 = i0 + WEIGHT_TILE < last ? i0 + WEIGHT_TILE : last;
+    j1 = j0 + WEIGHT_TILE < n ? j0 + WEIGHT_TILE : n;
+    TileDots(stream->nsc->matrix, stream->nsc->d, i0, i1, j0, j1, dots);
+    for (i = i0; i < i1; ++i) {
+      row = stream->block + (size_t) (i - stream->first_row) * n;
+      if (i < j0 || i >= j1) {
+        WeightsFromDots(stream->nsc, stream->norms, i,
+                        dots + (i - i0) * WEIGHT_TILE - j0, j0, j1, row);
+      } else {
+        WeightsFromDots(stream->nsc, stream->norms, i,
+                        dots + (i - i0) * WEIGHT_TILE - j0, j0, i, row);
+        row[i] = 0;
+        WeightsFromDots(stream->nsc, stream->norms, i,
+                        dots + (i - i0) * WEIGHT_TILE - j0, i + 1, j1, row);
+      }
+      if (scale != NULL)
+        for (j = j0; j < j1; ++j)
+          row[j] = (i == j ? 1.0 : 0.0)
+              - (i <= j ? scale[i] * row[j] * scale[j]
+                        : scale[j] * row[j] * scale[i]);
+    }
+  }
+  FreeMatrix(&dots);
+}
+static void StreamDegrees(void *args, int begin, int end) {
+  /* the degrees of block rows [begin, end), a plain row scan */
+  StreamBlock *stream = (StreamBlock *) args;
+  const double *row;
+  int i, j, n = stream->nsc->n;
+  for (i = begin; i < end; ++i) {
+    row = stream->block + (size_t) i * n;
+    stream->degrees[stream->first_row + i] = 0;
+    for (j = 0; j < n; ++j)
+      stream->degrees[stream->first_row + i] += row[j];
+  }
+}
+static void StreamBlocks(Nsc *nsc, StreamBlock *stream, int print) {
+  /* every block of rows, printed or summed into stream->degrees */
+  ThreadPool *pool = NscThreadPool(nsc);
+  int n = nsc->n;
+  for (stream->first_row = 0; stream->first_row < n;
+       stream->first_row += stream->rows) {
+    stream->rows = n - stream->first_row < stream->block_rows
+                   ? n - stream->first_row : stream->block_rows;
+    ParallelFor(pool, StreamTiles, stream,
+                (stream->rows + WEIGHT_TILE - 1) / WEIGHT_TILE
+                    * stream->column_tiles);
+    if (print)
+      PrintMatrix(pool, stream->block, stream->rows, n);
+    else
+      ParallelFor(pool, StreamDegrees, stream, stream->rows);
+  }
+}
+void StreamGoal(Nsc *nsc) {
+  StreamBlock stream;
+  double *norms, *degrees, *scale = NULL;
+  int i, n = nsc->n;
+  AllocateMatrix(&norms, 1, n);
+  AllocateMatrix(&degrees, 1, n);
+  SquaredNorms(nsc, norms);
+  stream.nsc = nsc;
+  stream.norms = norms;
+  stream.scale = NULL;
+  stream.degrees = degrees;
+  stream.column_tiles = (n + WEIGHT_TILE - 1) / WEIGHT_TILE;
+  stream.block_rows = nsc->stream_rows < n ? nsc->stream_rows : n;
+  AllocateMatrix(&stream.block, stream.block_rows, n);
+  if (nsc->goal == WAM) {
+    StreamBlocks(nsc, &stream, 1);
+  } else {
+    StreamBlocks(nsc, &stream, 0);
+    if (nsc->goal == DDG) {
+      PrintDiagonalMatrix(NscThreadPool(nsc), degrees, n);
+    } else {
+      /* as in InversedSqrtDiagonalDegreeMatrix */
+      AllocateMatrix(&scale, 1, n);
+      for (i = 0; i < n; ++i)
+        scale[i] = degrees[i] > 0 ? 1 / (sqrt(degrees[i])) : 0;
+      stream.scale = scale;
+      StreamBlocks(nsc, &stream, 1);
+      FreeMatrix(&scale);
+    }
+  }
+  FreeMatrix(&stream.block);
+  FreeMatrix(&degrees);
+  FreeMatrix(&norms);
+}
+
 /*
  * Math helper functions
  */
-double CalculateEuclideanDistance(double vector_1[], double vector_2[], int d) {
+double CalculateEuclideanDistance(const double vector_1[],
+                                  const double vector_2[], int d) {
   /***
    * calculate and return the standard Euclidean distance
    * as defined in the project requirements.
    */
-  double sum_of_squares = 0;
+  double sum_of_squares = 0, difference;
   int i;
-  for (i = 0; i < d; ++i)
-    sum_of_squares += pow(vector_2[i] - vector_1[i], 2);
+  for (i = 0; i < d; ++i) {
+    difference = vector_2[i] - vector_1[i];
+    sum_of_squares += difference * difference;
+  }
   return sqrt(sum_of_squares);
 }
 void SubTwoMatrices(const double matrix_1[],
                     const double matrix_2[],
                     double sub[],
                     int n) {
+  size_t i = 0, size = (size_t) n * n;
+#ifdef __AVX2__
+  for (; i + 4 <= size; i += 4)
+    _mm256_storeu_pd(sub + i, _mm256_sub_pd(_mm256_loadu_pd(matrix_1 + i),
+                                            _mm256_loadu_pd(matrix_2 + i)));
+#endif
+  for (; i < size; ++i)
+    sub[i] = matrix_1[i] - matrix_2[i];
+}
+/****** Dense products
+ * Gemm cuts C into tiles (at most GEMM_MC x GEMM_NC) which are the tasks
+ * of the pool. For every GEMM_KC deep slice of the inner dimension a task
+ * packs its blocks of op(A) and op(B) into GEMM_MR row and GEMM_NR column
+ * slivers, zero padded, and the micro kernel computes GEMM_MR x GEMM_NR of
+ * C from two slivers that stay in cache. Every element of C is summed by
+ * one task in a fixed order, so the result does not depend on the number
+ * of threads. With AVX2 enabled (NSC_NATIVE=1 builds) the micro kernel
+ * keeps its tile in vector registers and uses FMA *****/
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_KC 256
+#define GEMM_MC 128
+#define GEMM_NC 512
+
+typedef struct {
+  Transpose transpose_a, transpose_b;
+  int m, n, k, lda, ldb, ldc, tile_m, tile_n, tiles_n;
+  double alpha, beta;
+  const double *a, *b;
+  double *c;
+} GemmProblem;
+
+static void PackSlivers(const double *x, size_t stride, size_t depth_stride,
+                        int count, int depth, int width, double packed[]) {
+  /* count lines (rows of op(A) or columns of op(B)) of depth elements,
+   * element p of line l at x[l * stride + p * depth_stride], as slivers
+   * of width lines stored element by element */
+  int l, p, r;
+  for (l = 0; l < count; l += width, packed += (size_t) width * depth)
+    for (p = 0; p < depth; ++p)
+      for (r = 0; r < width; ++r)
+        packed[p * width + r] =
+            l + r < count ? x[(size_t) (l + r) * stride
+                              + (size_t) p * depth_stride] : 0;
+}
+
+#ifdef __AVX2__
+#ifdef __FMA__
+#define MULTIPLY_ADD(x, y, z) _mm256_fmadd_pd(x, y, z)
+#else
+#define MULTIPLY_ADD(x, y, z) _mm256_add_pd(_mm256_mul_pd(x, y), z)
+#endif
+static void MicroKernel(int depth, const double *a, const double *b,
+                        double tile[]) {
+  /* tile = sum_p a_p b_p^T of a GEMM_MR and a GEMM_NR sliver */
+  __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd(),
+      c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd(),
+      c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd(),
+      c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd(), b0, b1, x;
+  int p;
+  for (p = 0; p < depth; ++p, a += GEMM_MR, b += GEMM_NR) {
+    b0 = _mm256_loadu_pd(b);
+    b1 = _mm256_loadu_pd(b + 4);
+    x = _mm256_broadcast_sd(a);
+    c00 = MULTIPLY_ADD(x, b0, c00);
+    c01 = MULTIPLY_ADD(x, b1, c01);
+    x = _mm256_broadcast_sd(a + 1);
+    c10 = MULTIPLY_ADD(x, b0, c10);
+    c11 = MULTIPLY_ADD(x, b1, c11);
+    x = _mm256_broadcast_sd(a + 2);
+    c20 = MULTIPLY_ADD(x, b0, c20);
+    c21 = MULTIPLY_ADD(x, b1, c21);
+    x = _mm256_broadcast_sd(a + 3);
+    c30 = MULTIPLY_ADD(x, b0, c30);
+    c31 = MULTIPLY_ADD(x, b1, c31);
+  }
+  _mm256_storeu_pd(tile, c00);
+  _mm256_storeu_pd(tile + 4, c01);
+  _mm256_storeu_pd(tile + 8, c10);
+  _mm256_storeu_pd(tile + 12, c11);
+  _mm256_storeu_pd(tile + 16, c20);
+  _mm256_storeu_pd(tile + 20, c21);
+  _mm256_storeu_pd(tile + 24, c30);
+  _mm256_storeu_pd(tile + 28, c31);
+}
+#else
+static void MicroKernel(int depth, const double *a, const double *b,
+                        double tile[]) {
+  /* tile = sum_p a_p b_p^T of a GEMM_MR and a GEMM_NR sliver */
+  int p, r, c;
+  for (r = 0; r < GEMM_MR * GEMM_NR; ++r)
+    tile[r] = 0;
+  for (p = 0; p < depth; ++p, a += GEMM_MR, b += GEMM_NR)
+    for (r = 0; r < GEMM_MR; ++r)
+      for (c = 0; c < GEMM_NR; ++c)
+        tile[r * GEMM_NR + c] += a[r] * b[c];
+}
+#endif
+
+static void StoreTile(const GemmProblem *g, const double tile[], int i0,
+                      int j0, int rows, int cols, int first) {
+  /* C = alpha tile + beta C on the first slice, C += alpha tile after */
   int i, j;
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < n; j++) {
-      sub[i * n + j] = matrix_1[i * n + j] - matrix_2[i * n + j];
+  double *c;
+  for (i = 0; i < rows; ++i) {
+    c = g->c + (size_t) (i0 + i) * g->ldc + j0;
+    for (j = 0; j < cols; ++j) {
+      if (!first)
+        c[j] += g->alpha * tile[i * GEMM_NR + j];
+      else if (g->beta == 0) /* C may be uninitialized */
+        c[j] = g->alpha * tile[i * GEMM_NR + j];
+      else
+        c[j] = g->alpha * tile[i * GEMM_NR + j] + g->beta * c[j];
     }
   }
 }
+
+static void GemmTiles(void *args, int begin, int end) {
+  /* tiles [begin, end) of C, in row major order */
+  GemmProblem *g = (GemmProblem *) args;
+  double *packed_a, *packed_b, tile[GEMM_MR * GEMM_NR];
+  int t, i, j, p0, i0, j0, rows, cols, depth;
+  packed_a = malloc((size_t) g->tile_m * GEMM_KC * sizeof(double));
+  packed_b = malloc((size_t) g->tile_n * GEMM_KC * sizeof(double));
+  assert(packed_a != NULL && packed_b != NULL);
+  for (t = begin; t < end; ++t) {
+    i0 = t / g->tiles_n * g->tile_m;
+    j0 = t % g->tiles_n * g->tile_n;
+    rows = g->m - i0 < g->tile_m ? g->m - i0 : g->tile_m;
+    cols = g->n - j0 < g->tile_n ? g->n - j0 : g->tile_n;
+    /* one pass even for k == 0, which leaves C = beta C */
+    for (p0 = 0; p0 == 0 || p0 < g->k; p0 += GEMM_KC) {
+      depth = g->k - p0 < GEMM_KC ? g->k - p0 : GEMM_KC;
+      if (g->transpose_a == TRANSPOSE)
+        PackSlivers(g->a + (size_t) p0 * g->lda + i0, 1, g->lda, rows,
+                    depth, GEMM_MR, packed_a);
+      else
+        PackSlivers(g->a + (size_t) i0 * g->lda + p0, g->lda, 1, rows,
+                    depth, GEMM_MR, packed_a);
+      if (g->transpose_b == TRANSPOSE)
+        PackSlivers(g->b + (size_t) j0 * g->ldb + p0, g->ldb, 1, cols,
+                    depth, GEMM_NR, packed_b);
+      else
+        PackSlivers(g->b + (size_t) p0 * g->ldb + j0, 1, g->ldb, cols,
+                    depth, GEMM_NR, packed_b);
+      for (j = 0; j < cols; j += GEMM_NR) {
+        for (i = 0; i < rows; i += GEMM_MR) {
+          MicroKernel(depth, packed_a + (size_t) i * depth,
+                      packed_b + (size_t) j * depth, tile);
+          StoreTile(g, tile, i0 + i, j0 + j,
+                    rows - i < GEMM_MR ? rows - i : GEMM_MR,
+                    cols - j < GEMM_NR ? cols - j : GEMM_NR, p0 == 0);
+        }
+      }
+    }
+  }
+  free(packed_a);
+  free(packed_b);
+}
+
+void Gemm(ThreadPool *pool, Transpose transpose_a, Transpose transpose_b,
+          int m, int n, int k, double alpha, const double a[], int lda,
+          const double b[], int ldb, double beta, double c[], int ldc) {
+  GemmProblem g;
+  int num_threads = pool == NULL ? 1 : pool->num_threads;
+  if (m <= 0 || n <= 0)
+    return;
+  g.transpose_a = transpose_a;
+  g.transpose_b = transpose_b;
+  g.m = m;
+  g.n = n;
+  g.k = k;
+  g.lda = lda;
+  g.ldb = ldb;
+  g.ldc = ldc;
+  g.alpha = alpha;
+  g.beta = beta;
+  g.a = a;
+  g.b = b;
+  g.c = c;
+  /* smaller tiles until every thread has a few, e.g. for the m x m
+   * result of a tall A^T B */
+  g.tile_m = GEMM_MC;
+  g.tile_n = GEMM_NC;
+  while ((size_t) ((m + g.tile_m - 1) / g.tile_m)
+             * ((n + g.tile_n - 1) / g.tile_n) < 4 * (size_t) num_threads
+         && (g.tile_n > 8 * GEMM_NR || g.tile_m > 8 * GEMM_MR)) {
+    if (g.tile_n > 8 * GEMM_NR && g.tile_n >= 4 * g.tile_m)
+      g.tile_n /= 2;
+    else if (g.tile_m > 8 * GEMM_MR)
+      g.tile_m /= 2;
+    else
+      g.tile_n /= 2;
+  }
+  g.tiles_n = (n + g.tile_n - 1) / g.tile_n;
+  if (pool == NULL)
+    GemmTiles(&g, 0, (m + g.tile_m - 1) / g.tile_m * g.tiles_n);
+  else
+    ParallelFor(pool, GemmTiles, &g,
+                (m + g.tile_m - 1) / g.tile_m * g.tiles_n);
+}
 void MultiplyTwoMatrices(const double matrix_1[],
                          const double matrix_2[],
                          double product[],
                          int n) {
-  int i, j, k;
-  double sum_of_products = 0;
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < n; j++) {
-      for (k = 0; k < n; k++) {
-        sum_of_products += matrix_1[i * n + k] * matrix_2[k * n + j];
-      }
-      product[i * n + j] = sum_of_products;
-      sum_of_products = 0;
-    }
-  }
+  Gemm(NULL, NO_TRANSPOSE, NO_TRANSPOSE, n, n, n, 1, matrix_1, n, matrix_2,
+       n, 0, product, n);
 }
 void IdentityMatrix(double identity[], int n) {
   int i, j;
@@ -575,12 +3234,26 @@ double FindMin(const double *values, int n) {
 
 }
 
+/* sqrt(a^2 + b^2) without overflow or underflow */
+double Hypotenuse(double a, double b) {
+  double r;
+  if (fabs(a) > fabs(b)) {
+    r = b / a;
+    return fabs(a) * sqrt(1 + r * r);
+  }
+  if (b != 0) {
+    r = a / b;
+    return fabs(b) * sqrt(1 + r * r);
+  }
+  return 0.0;
+}
+
 /*this func calculates U matrix*/
 void CalculateUMatrix(Nsc *nsc, double *u, int k) {
   int i, j;
   for (i = 0; i < nsc->n; i++) {
     for (j = 0; j < k; j++) {
-      u[i * k + j] = nsc->eigen_vectors[i * nsc->n + j];
+      u[i * k + j] = nsc->eigen_vectors[i * nsc->num_eigen + j];
     }
   }
 }
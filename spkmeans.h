@@ -1,6 +1,13 @@
 #ifndef TEST_SPKMEANS_LIB__SPKMEANS_H_
 #define TEST_SPKMEANS_LIB__SPKMEANS_H_
 #include "stdio.h"
+/* Symmetric n x n matrices (wam, l_norm, the Jacobi working matrix) are
+ * stored packed: the upper triangle row by row, n(n+1)/2 doubles.
+ * Element (i, j) with i <= j is at PACKED_ROW(i, n) + j */
+#define PACKED_SIZE(n) ((size_t) (n) * ((size_t) (n) + 1) / 2)
+#define PACKED_ROW(i, n) ((size_t) (i) * (2 * (size_t) (n) - (i) - 1) / 2)
+#define PACKED_INDEX(i, j, n) \
+  ((i) <= (j) ? PACKED_ROW(i, n) + (j) : PACKED_ROW(j, n) + (i))
 typedef enum {
   WAM,
   DDG,
@@ -8,27 +15,131 @@ typedef enum {
   JACOBI,
   FIT
 } Goal;
+/* Eigensolver used by CalculateEigenpairs */
+typedef enum {
+  CLASSIC_JACOBI, /* rotate the largest off diagonal element, <= 100 times */
+  CYCLIC_JACOBI, /* parallel sweeps over all (p,q) pairs until convergence */
+  HOUSEHOLDER_QL, /* tridiagonal reduction followed by implicit QL */
+  LANCZOS /* leading eigenpairs only, thick restart Lanczos */
+} EigenSolver;
+/* Affinity graph of the data points */
+typedef enum {
+  DENSE_GRAPH, /* all pairs, packed wam and l_norm */
+  KNN_GRAPH, /* num_neighbours nearest points of every point, symmetrized */
+  CUTOFF_GRAPH /* the pairs with a weight of at least cutoff */
+} GraphMode;
+/* Compressed sparse rows: row i holds the entries
+ * [row_start[i], row_start[i + 1]), columns increasing */
+typedef struct {
+  int n;
+  size_t *row_start;
+  int *columns;
+  double *values;
+} SparseMatrix;
+/* Landmark choice of the Nystrom approximation */
+typedef enum {
+  UNIFORM_LANDMARKS,
+  KMEANS_PP_LANDMARKS /* D^2 sampling as in k-means++ */
+} LandmarkSampling;
+/* Pipeline stages, a bit in Nsc.valid_stages once computed. A stage
+ * computes its missing upstream stages and is not computed twice */
+typedef enum {
+  STAGE_WAM = 1,
+  STAGE_DDG = 2,
+  STAGE_INVERSED_SQRT_DDG = 4,
+  STAGE_L_NORM = 8,
+  STAGE_EIGEN = 16
+} Stage;
+/* Operand of Gemm, used as stored or transposed */
+typedef enum {
+  NO_TRANSPOSE,
+  TRANSPOSE
+} Transpose;
+/* Worker threads shared by the parallel parts of the library */
+typedef struct thread_pool ThreadPool;
+/* Runs task on [begin, end) sub ranges of [0, count) */
+typedef void (*ParallelTask)(void *args, int begin, int end);
+/* Binary data points: a BINARY_HEADER_SIZE byte little endian header,
+ * the magic "NSCDATA\0", version and dtype as 32 bit and n and d as 64 bit
+ * integers, followed by the n x d row major values */
+#define BINARY_MAGIC "NSCDATA"
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 32
+typedef enum {
+  BINARY_FLOAT64 = 1,
+  BINARY_FLOAT32 = 2
+} BinaryType;
+/* Rows per block of the --stream option */
+#define STREAM_ROWS 256
+/* The data points of an input file. A little endian float64 binary file
+ * is used in place from its mapping, anything else is copied to owned */
+typedef struct {
+  const double *points; /* n x d */
+  int n, d;
+  void *mapping;
+  size_t mapping_size;
+  double *owned;
+} DataFile;
 typedef struct normalized_spectral_clustering {
   /**
    * n: number of data data_points
    * d: data point dimension
-   * k: number of required clusters
+   * k: number of required clusters, 0 for the eigengap heuristic
+   * num_eigen: number of computed eigenpairs, eigen_vectors is n x num_eigen,
+   * 0 after the eigensolver failed to converge
+   * ddg, inversed_sqrt_ddg: the diagonals only, length n
+   * graph: with a sparse graph the wam and l_norm stages fill sparse_wam
+   * and sparse_l_norm instead of wam and l_norm
+   * The library keeps no state outside the Nsc, so independent Nsc
+   * objects may be used from different threads at the same time
    */
 
-  double *matrix, *ddg, *inversed_sqrt_ddg, *wam, *l_norm,
-      *eigen_vectors, *eigen_values;
-  int n, d, i_pivot, j_pivot;
+  const double *matrix; /* the n x d data points, borrowed */
+  double *ddg, *inversed_sqrt_ddg, *wam, *l_norm, *eigen_vectors,
+      *eigen_values;
+  int n, d, k, num_eigen, i_pivot, j_pivot;
   double s, c, epsilon;
   Goal goal;
+  EigenSolver eigen_solver;
+  GraphMode graph;
+  int num_neighbours; /* KNN_GRAPH */
+  double cutoff; /* CUTOFF_GRAPH */
+  SparseMatrix *sparse_wam, *sparse_l_norm;
+  int num_landmarks; /* > 0: fit uses the Nystrom approximation */
+  LandmarkSampling landmark_sampling;
+  int stream_rows; /* > 0: dense wam, ddg and lnorm print this many rows at
+                    * a time, see StreamGoal */
+  int valid_stages; /* Stage bits of the buffers holding results */
+  int num_threads; /* size of pool, created on first use */
+  ThreadPool *pool;
 } Nsc;
 
 /* standalone client */
 void InvalidInput();
 void GeneralError();
-void PrintMatrix(const double *matrix, int rows, int d);
+/* The Print functions write "%.4f" values, rows formatted in parallel
+ * on pool unless it is NULL */
+void PrintMatrix(ThreadPool *pool, const double *matrix, int rows, int d);
+/* Print a packed symmetric matrix as the full n x n matrix */
+void PrintSymmetricMatrix(ThreadPool *pool, const double *packed, int n);
+/* Print the n x n diagonal matrix with the given diagonal */
+void PrintDiagonalMatrix(ThreadPool *pool, const double *diagonal, int n);
+/* Print a sparse matrix as the full n x n matrix */
+void PrintSparseMatrix(ThreadPool *pool, const SparseMatrix *matrix);
+/* The dense wam, ddg or lnorm goal printed in blocks of nsc->stream_rows
+ * rows, O(nd + stream_rows n) memory. lnorm computes the weights twice */
+void StreamGoal(Nsc *nsc);
 void AllocateMatrix(double **matrix, int n, int d);
+/* Room for a packed symmetric n x n matrix, see PACKED_ROW */
+void AllocateSymmetricMatrix(double **matrix, int n);
 void FreeMatrix(double **matrix);
-void ChooseGoal(Nsc *nsc);
+/* Room for an n x n sparse matrix with nnz entries */
+void AllocateSparseMatrix(SparseMatrix **matrix, int n, size_t nnz);
+void FreeSparseMatrix(SparseMatrix **matrix);
+/* Compute and print the goal of nsc, returns 0 if the eigensolver failed */
+int ChooseGoal(Nsc *nsc);
+/* Apply an optional command line argument to nsc, returns 0 if invalid */
+int ParseOption(const char *option, Nsc *nsc);
 
 /* the spectral clustering API (library functions) */
 
@@ -36,6 +147,14 @@ void ChooseGoal(Nsc *nsc);
 void CalculateWeightedAdjacencyMatrix(Nsc *nsc);
 /* Calculate and output the Diagonal Degree Matrix as described in 1.1.2. */
 void CalculateDiagonalDegreeMatrix(Nsc *nsc);
+/* The sparse wam of nsc->graph (k nearest neighbours or weight cutoff) */
+void CalculateSparseGraph(Nsc *nsc);
+/* The sparse l_norm of the sparse wam, the diagonal included */
+void CalculateSparseLaplacian(Nsc *nsc);
+/* 1 if every point of the sparse graph is reachable from point 0 */
+int SparseGraphIsConnected(const SparseMatrix *graph);
+/* The packed n x n form of a symmetric sparse matrix, see PACKED_ROW */
+void PackSparseMatrix(double packed[], const SparseMatrix *sparse);
 /* Calculate the Inversed Square root of the Diagonal Degree Matrix*/
 void InversedSqrtDiagonalDegreeMatrix(Nsc *nsc);
 /* Calculate and output the laplacian matrix */
@@ -43,35 +162,85 @@ void CalculateNormalizedGraphLaplacian(Nsc *nsc);
 /* Calculate and output the eigenvalues and eighen vectors of a given symetric
  * matrix based on Jacobi itrative method */
 void CalculateJacobi(Nsc *nsc);
+/* Same output as CalculateJacobi, computed by Householder tridiagonalization
+ * and implicit QL. Fully converged, O(n^3) overall */
+void CalculateHouseholderQL(Nsc *nsc);
+/* The leading eigenpairs only, as many as FindK will look at */
+void CalculateLanczos(Nsc *nsc);
+/* The eigenpairs of l_norm approximated from nsc->num_landmarks landmark
+ * points (at least k), without forming the n x n matrices */
+void CalculateNystrom(Nsc *nsc);
+/* Run the eigensolver selected by nsc->eigen_solver */
+void CalculateEigenpairs(Nsc *nsc);
 
 /* API helper functions */
-/* A constructor for Nsc objects */
-void ConstructNsc(Nsc *nsc, double *data_points, int n, int d, Goal
-goal);
+/* A constructor for Nsc objects. data_points is used in place and must
+ * outlive the Nsc */
+void ConstructNsc(Nsc *nsc, const double *data_points, int n, int d,
+                  Goal goal);
+/* Allocate nsc->eigen_values and nsc->eigen_vectors for m eigenpairs */
+void AllocateEigenpairs(Nsc *nsc, int m);
 /* A destructor for Nsc objects */
 void DestructNsc(Nsc *nsc);
-/* Calculat the input dimentions */
-void CalculateNandD(const char file_name[], int *n, int *d);
-/* Initialize an array with the data points */
-void BuildDataPointsMatrix(const char file_name[],
-                           double *data_points);
+/* Reads the comma separated rows of file_name into a new n x d matrix,
+ * blank lines skipped. 0 after a message on stderr if the file cannot be
+ * read or a row does not hold d numbers */
+int LoadDataPoints(const char file_name[], int num_threads,
+                   double **data_points, int *n, int *d);
+/* Maps a binary data points file, 0 after a message on stderr if it is
+ * not one */
+int MapDataPoints(const char file_name[], DataFile *file);
+/* Opens a binary or comma separated data points file, by its magic */
+int OpenDataFile(const char file_name[], int num_threads, DataFile *file);
+void CloseDataFile(DataFile *file);
 /* */
-void CalculateRotationMatrix(const double a[], double p[], int n, Nsc *nsc);
-void RunJacobiCalculations(double a[], double a_tag[], double p[], double
-v[], int n, Nsc *nsc);
-void FindPivot(const double a[], int n,
-               double *pivot, int *i_pivot, int *j_pivot);
+/* The Jacobi solvers work on a packed copy a of the input matrix */
+/* The c, s values of the rotation zeroing a[i_pivot][j_pivot] */
+void CalculateRotation(const double a[], int n, Nsc *nsc);
+void RunJacobiCalculations(double a[], int n, Nsc *nsc);
+/* Per row index of the largest upper triangle element, for FindPivot */
+int RowMax(const double a[], int n, int i);
+void UpdateRowMax(const double a[], int row_max[], int n, int i, int j);
+void FindPivot(const double a[], const int row_max[], int n,
+               int *i_pivot, int *j_pivot);
 int Sign(double theta);
 double Off(double a[], int n);
 void CopyMatrix(double a[], const double b[], int n, int d);
+/* Conversions between full n x n and packed symmetric storage. Packing
+ * keeps the upper triangle */
+void PackSymmetricMatrix(double packed[], const double full[], int n);
+void UnpackSymmetricMatrix(double full[], const double packed[], int n);
 double CalculateWeight(int i, int j, Nsc *nsc);
-void CalculateAPrimeEfficient(const double a[], double a_tag[], Nsc *nsc);
+/* Cyclic Jacobi, rotations of disjoint pairs run in parallel */
+void RunCyclicJacobiSweeps(double a[], int n, Nsc *nsc);
+/* A = P^TAP and V = VP in place, O(n) per rotation */
+void ApplyRotation(double a[], Nsc *nsc);
+void RotateEigenVectors(double v[], Nsc *nsc);
+/* Householder reduction to tridiagonal form and its implicit QL solver,
+ * which returns 0 if it did not converge */
+void Tridiagonalize(double z[], double d[], double e[], int n);
+int TridiagonalQL(double d[], double e[], double z[], int n);
+/* The m largest eigenpairs of the packed a, or of sparse when a is NULL,
+ * into nsc, in decreasing order. nsc->num_eigen is 0 if they did not
+ * converge within 100 restarts */
+void RunLanczos(Nsc *nsc, const double a[], const SparseMatrix *sparse,
+                int m);
+/* 1 if more eigenvalues cannot change the eigengap FindK picks, trace is
+ * the trace of the matrix */
+int EigengapIsFinal(const Nsc *nsc, double trace);
 int FindK(Nsc *nsc, int k);
 void CalculateUMatrix(Nsc *nsc, double *u, int k);
 void CalculateTMatrix(double *u, double *t, int n, int k);
 
+/* Parallel helpers */
+ThreadPool *CreateThreadPool(int num_threads);
+void DestroyThreadPool(ThreadPool *pool);
+void ParallelFor(ThreadPool *pool, ParallelTask task, void *args, int count);
+ThreadPool *NscThreadPool(Nsc *nsc);
+
 /* Math helper functions */
-double CalculateEuclideanDistance(double vector_1[], double vector_2[], int d);
+double CalculateEuclideanDistance(const double vector_1[],
+                                  const double vector_2[], int d);
 void SubTwoMatrices(const double matrix_1[],
                     const double matrix_2[],
                     double sub[],
@@ -80,10 +249,17 @@ void MultiplyTwoMatrices(const double matrix_1[],
                          const double matrix_2[],
                          double product[],
                          int n);
+/* C = alpha op(A) op(B) + beta C for the row major m x k op(A), k x n
+ * op(B) and m x n C, lda, ldb and ldc are their row lengths in memory.
+ * Runs on pool, or on the calling thread if pool is NULL */
+void Gemm(ThreadPool *pool, Transpose transpose_a, Transpose transpose_b,
+          int m, int n, int k, double alpha, const double a[], int lda,
+          const double b[], int ldb, double beta, double c[], int ldc);
 void IdentityMatrix(double identity[], int n);
 int CheckDiagonal(const double a[], int n);
 int IndexOfMinValue(const double *values, int n);
 int IndexOfMaxValue(const double *values, int n);
 double FindMax(const double *values, int n);
 double FindMin(const double *values, int n);
+double Hypotenuse(double a, double b);
 #endif
\ No newline at end of file
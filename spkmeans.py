@@ -1,33 +1,41 @@
-import math
 import sys
 import numpy as np
 import pandas as pd
 from argparse import *
 import finalmodule
+import nscdata
 
 np.random.seed(0)
 MAX_ITER = 300
+EIGEN_SOLVERS = {"classic": finalmodule.CLASSIC_JACOBI,
+                 "cyclic": finalmodule.CYCLIC_JACOBI,
+                 "ql": finalmodule.HOUSEHOLDER_QL,
+                 "lanczos": finalmodule.LANCZOS}
+LANDMARK_SAMPLINGS = {"uniform": finalmodule.UNIFORM_LANDMARKS,
+                      "kmeans++": finalmodule.KMEANS_PP_LANDMARKS}
 
 
-def print_output_centroids(km):
+def print_output_centroids(centroids):
     """
     outputs the final centroids calculated by kmeans.c
     """
-    for centroid in km.output:
+    for centroid in np.asarray(centroids):
         print(','.join(["%.4f" % coordinate for coordinate in centroid]))
 
 
-def print_centroid_indices(km):
+def print_centroid_indices(centroids_indices):
     """
     outputs the final centroids indexes.
     """
-    print(','.join([f"{int(i)}" for i in km.centroids_indices]))
+    print(','.join([f"{int(i)}" for i in centroids_indices]))
 
 
 class SpectralClustering:
     """ main data structure to support the algorithm implementation """
 
-    def __init__(self, n, d, k, goal, data_points, max_iter):
+    def __init__(self, n, d, k, goal, data_points, max_iter, eigen_solver=finalmodule.CLASSIC_JACOBI,
+                 num_threads=1, num_neighbours=0, cutoff=0, num_landmarks=0,
+                 landmark_sampling=finalmodule.UNIFORM_LANDMARKS):
         """"
         reads the data data_points from the given input file into an array.
         :param n: number of data data_points in the input file. (<=1000)
@@ -39,6 +47,12 @@ class SpectralClustering:
                     ddg: Calculate and output the Diagonal Degree Matrix as described in 1.1.2.
                     lnorm: Calculate and output the Normalized Graph Laplacian as described in 1.1.3.
                     jacobi: Calculate and output the eigenvalues and eigenvectors as described in 1.2.1.
+        :param eigen_solver: one of the finalmodule eigensolver constants, used by spk and jacobi.
+        :param num_threads: number of threads the C extension may use.
+        :param num_neighbours: if > 0 the affinity graph keeps only the nearest neighbours of every point.
+        :param cutoff: if > 0 (and no num_neighbours) the affinity graph keeps only weights >= cutoff.
+        :param num_landmarks: if > 0 spk approximates the eigenvectors from this many landmark points (Nystrom).
+        :param landmark_sampling: how the landmarks are drawn, one of the finalmodule landmark constants.
         """""
         self.data_points = data_points
         self.n = n
@@ -46,6 +60,12 @@ class SpectralClustering:
         self.k = k
         self.goal = goal
         self.max_iter = max_iter
+        self.eigen_solver = eigen_solver
+        self.num_threads = num_threads
+        self.num_neighbours = num_neighbours
+        self.cutoff = cutoff
+        self.num_landmarks = num_landmarks
+        self.landmark_sampling = landmark_sampling
 
 
 def parse_input():
@@ -58,9 +78,18 @@ def parse_input():
     parser.add_argument("k")
     parser.add_argument("goal", type=str)
     parser.add_argument("file_name", type=str)
+    parser.add_argument("--eigen", choices=EIGEN_SOLVERS.keys(), default="classic")
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--knn", type=int, default=0)
+    parser.add_argument("--cutoff", type=float, default=0)
+    parser.add_argument("--landmarks", type=int, default=0)
+    parser.add_argument("--landmark-init", choices=LANDMARK_SAMPLINGS.keys(), default="uniform")
     args = parser.parse_args()
     file_name = args.file_name
-    data_points = pd.read_csv(file_name, header=None)
+    if nscdata.is_binary(file_name):
+        data_points = nscdata.read_binary(file_name)  # mapped, not parsed
+    else:
+        data_points = pd.read_csv(file_name, header=None).to_numpy()
     n = data_points.shape[0]
     d = data_points.shape[1]
     k = args.k  # if k == 0 use the Eigengap Heuristic
@@ -70,8 +99,14 @@ def parse_input():
     if not 0 <= k < n:
         invalid_input()
     goal = args.goal
-    # data_point is flattem and converted to a list to match C/API input
-    return SpectralClustering(n, d, k, goal, data_points.to_numpy().flatten().tolist(), MAX_ITER)
+    if args.threads < 1 or args.knn < 0 or not 0 <= args.cutoff <= 1:
+        invalid_input()
+    if args.landmarks < 0 or 0 < args.landmarks < k:
+        invalid_input()
+    # a C contiguous float64 array, finalmodule reads it in place
+    return SpectralClustering(n, d, k, goal, np.ascontiguousarray(data_points, dtype=np.float64), MAX_ITER,
+                              EIGEN_SOLVERS[args.eigen], args.threads, args.knn, args.cutoff,
+                              args.landmarks, LANDMARK_SAMPLINGS[args.landmark_init])
 
 
 # parse data and call the appropriate spkmeans function based on the goal
@@ -86,14 +121,12 @@ def general_error():
     sys.exit()
 
 
-def print_matrix(matrix, n, d):
-    for i in range(n):
-        for j in range(d):
-            if j != d - 1:
-                print('%.4f,' % matrix[i * d + j], end="")
-            else:
-                print('%.4f' % matrix[i * d + j], end="")
-        print("")
+def print_matrix(matrix):
+    """
+    outputs a finalmodule.Matrix (or any 2 dimensional array) row by row.
+    """
+    for row in np.asarray(matrix):
+        print(','.join(["%.4f" % value for value in row]))
 
 
 class KMeans:
@@ -118,8 +151,6 @@ class KMeans:
         self.centroids = pd.array([])
         self.centroids_indices = []
         self.output = None
-        self.D = np.array([])
-        self.P = np.array([])
 
     def initialize_data_points(self, data_points=None):
         """
@@ -137,61 +168,43 @@ class KMeans:
         else:
             self.data_points = data_points
 
-    def find_min_distance(self, data_point):
-        """
-        a function to compute the minimal distance between a given data frame to the current existing
-        centroids. assumes centroids is not empty.
-        param data_point: a given data point to compute the minimal distance for.
-        :return: the minimal distance between the input and the centroids.
-        """
-        m = math.inf
-        for i in range(self.centroids.shape[0]):
-            m = min(m, np.sum(np.power(np.subtract(data_point, self.centroids[i]), 2)))
-        return m
-
     def k_means_pp(self):
         """
         an implementation of the kmeans++ algorithm to generate initial centroids
         for the use of a kmeans clustering algorithm implementation.
-        assumes initialize_centroids() was already called.
+        the seeding runs in finalmodule and draws what np.random.seed(0) would.
         :return: a float type data frame that contains the randomly chosen centroids.
         """
-        np.random.seed(0)
-        miu1_index = np.random.choice(range(self.number_of_rows))
-        self.centroids = np.array([self.data_points[miu1_index]])
-        self.centroids_indices.append(miu1_index)
-        for i in range(1, self.k):
-            self.D = np.array([self.find_min_distance(self.data_points[curr])
-                               for curr in range(self.number_of_rows)])
-            sum_d = np.sum(self.D)
-            self.P = np.array([d / sum_d for d in self.D])
-            random_centroid_i = np.random.choice(range(self.number_of_rows), p=self.P)
-            self.centroids = np.append(self.centroids,
-                                       np.array([self.data_points[random_centroid_i]]), axis=0)
-            self.centroids_indices.append(random_centroid_i)
+        data_points = np.ascontiguousarray(self.data_points, dtype=np.float64)
+        self.centroids_indices = finalmodule.kmeans_pp(data_points, self.number_of_rows,
+                                                       self.number_of_cols, self.k, 0)
+        self.centroids = data_points[self.centroids_indices]
 
 
 def main():
     spk = parse_input()
     if spk.goal == 'spk':
-        tuple_t_k = finalmodule.fit(spk.data_points, spk.n, spk.d, spk.k)
-        t = tuple_t_k[0]
-        spk.k = tuple_t_k[1]
-        t = np.reshape(t, (spk.n, spk.k))
-        kmeans = KMeans(spk.k, 0, file_name_1=None, file_name_2=None, data_points=t)
-        kmeans.k_means_pp()
-        print_centroid_indices(kmeans)
-        kmeans.output = finalmodule.fit_kmeans(
-            spk.n, spk.k, spk.max_iter, spk.k, kmeans.epsilon, kmeans.centroids.tolist(), kmeans.data_points.tolist())
-        print_output_centroids(kmeans)
+        # T, the k-means++ seeding and kmeans in one C call, None if k is not in (1, n)
+        result = finalmodule.spk(spk.data_points, spk.n, spk.d, spk.k, spk.eigen_solver,
+                                 spk.num_threads, spk.num_neighbours, spk.cutoff,
+                                 spk.num_landmarks, spk.landmark_sampling, spk.max_iter, 0, 0)
+        if result is None:
+            invalid_input()
+        print_centroid_indices(result[0])
+        print_output_centroids(result[1])
     elif spk.goal == "wam":
-        print_matrix(finalmodule.compute_wam(spk.data_points, spk.n, spk.d), spk.n, spk.n)
+        print_matrix(finalmodule.compute_wam(spk.data_points, spk.n, spk.d, spk.num_threads,
+                                             spk.num_neighbours, spk.cutoff))
     elif spk.goal == "ddg":
-        print_matrix(finalmodule.compute_ddg(spk.data_points, spk.n, spk.d), spk.n, spk.n)
+        print_matrix(finalmodule.compute_ddg(spk.data_points, spk.n, spk.d, spk.num_threads,
+                                             spk.num_neighbours, spk.cutoff))
     elif spk.goal == "lnorm":
-        print_matrix(finalmodule.compute_lnorm(spk.data_points, spk.n, spk.d), spk.n, spk.n)
+        print_matrix(finalmodule.compute_lnorm(spk.data_points, spk.n, spk.d, spk.num_threads,
+                                               spk.num_neighbours, spk.cutoff))
     elif spk.goal == "jacobi":
-        print_matrix(finalmodule.compute_jacobi(spk.data_points, spk.n, spk.d), spk.n + 1, spk.n)
+        # eigenvalues row, then the eigenvectors. partial eigensolvers return fewer than n
+        print_matrix(finalmodule.compute_jacobi(spk.data_points, spk.n, spk.d, spk.eigen_solver,
+                                                spk.num_threads))
     else:
         invalid_input()
 
@@ -1,6 +1,9 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "spkmeans.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 /*****************************************************************************
 
 @author: mohammad daghash
@@ -13,17 +16,7 @@ Implementation of the Normalized Spectral Clustering algorithm.
 ******************************************************************************/
 /* C API code kmeans */
 
-static void free_2d_arr(double** m, int rows) {
-/*
-function to free memory allocated for 2d array.
-*/
-  int i;
-  for (i = 0; i < rows; ++i) {
-    free(m[i]);
-  }
-  free(m);
-}
-static int is_converged(double *centroids, double *old_centroids, int K, int d, double epsilon) {
+static int is_converged(double *centroids, double *old_centroids, int K, int d, int stride, double epsilon) {
 /*
 checks if the convergence criteria has been reached.
 */
@@ -35,7 +28,7 @@ checks if the convergence criteria has been reached.
   for (i = 0; i < K; i++) {
     norm = 0;
     for (j = 0; j < d; j++) {
-      norm += pow(centroids[i * d + j] - old_centroids[i * d + j], 2);
+      norm += pow(centroids[i * stride + j] - old_centroids[i * stride + j], 2);
     }
     norm = pow(norm, 0.5);
     if (norm >= epsilon) {
@@ -44,320 +37,1026 @@ checks if the convergence criteria has been reached.
   }
   return 0;
 }
-static int index_of_closest_cluster(double *x, double *centroids, int K, int d) {
+static double squared_distance(const double *x, const double *y, int d) {
+  /* ||x - y||^2, summed in coordinate order */
+  double sum = 0;
+  int i;
+  for (i = 0; i < d; i++)
+    sum += (x[i] - y[i]) * (x[i] - y[i]);
+  return sum;
+}
 /*
-calculating the index of the closest cluster to the given data point.
+Data layout: run() copies the points into one aligned block with the rows
+padded by zeros to a multiple of KMEANS_LANES, and keeps the centroids the
+same way. For the assignment the centroids are also stored transposed
+(d x k_stride), so a distance kernel compares a point with KMEANS_LANES
+centroids at once. Every distance is still summed in coordinate order, the
+same value squared_distance() gives. The kernels are generated for every
+d up to SMALL_DIMENSIONS with a constant trip count, which the compiler
+unrolls, and once for any d.
 */
-  double min = 0;
-  double sum;
-  int i, j, index = 0;
-  /* minimum initialisation. (the fis  */
-  for (i = 0; i < d; i++) {
-    min += pow(x[i] - centroids[i], 2);
-  }
+#define KMEANS_LANES 4
+#define KMEANS_ALIGNMENT 32
+#define SMALL_DIMENSIONS 8
+#define ROUND_UP_TO_LANES(x) (((x) + KMEANS_LANES - 1) / KMEANS_LANES * KMEANS_LANES)
+
+static double *aligned_matrix(int rows, int cols) {
+  /* a zeroed rows x cols matrix aligned to KMEANS_ALIGNMENT, free() it.
+   * NULL if out of memory */
+  void *block = NULL;
+  size_t size = (size_t) rows * cols * sizeof(double);
+  if (posix_memalign(&block, KMEANS_ALIGNMENT, size > 0 ? size : KMEANS_ALIGNMENT) != 0)
+    return NULL;
+  memset(block, 0, size);
+  return (double *) block;
+}
+typedef void (*DistanceKernel)(const double *x, const double *columns, int d, int k_stride,
+                               double distances[]);
+
+#ifdef __AVX2__
+#define DEFINE_DISTANCE_KERNEL(name, dimension)                                          \
+static void name(const double *x, const double *columns, int d, int k_stride,            \
+                 double distances[]) {                                                   \
+  int c, j;                                                                              \
+  __m256d sum, difference;                                                               \
+  (void) d;                                                                              \
+  for (c = 0; c < k_stride; c += KMEANS_LANES) {                                         \
+    sum = _mm256_setzero_pd();                                                           \
+    for (j = 0; j < (dimension); j++) {                                                  \
+      difference = _mm256_sub_pd(_mm256_set1_pd(x[j]),                                   \
+                                 _mm256_load_pd(columns + (size_t) j * k_stride + c));   \
+      sum = _mm256_add_pd(sum, _mm256_mul_pd(difference, difference));                   \
+    }                                                                                    \
+    _mm256_storeu_pd(distances + c, sum);                                                \
+  }                                                                                      \
+}
+#else
+#define DEFINE_DISTANCE_KERNEL(name, dimension)                                          \
+static void name(const double *x, const double *columns, int d, int k_stride,            \
+                 double distances[]) {                                                   \
+  int c, j, l;                                                                           \
+  double sum[KMEANS_LANES], difference;                                                  \
+  (void) d;                                                                              \
+  for (c = 0; c < k_stride; c += KMEANS_LANES) {                                         \
+    for (l = 0; l < KMEANS_LANES; l++)                                                   \
+      sum[l] = 0;                                                                        \
+    for (j = 0; j < (dimension); j++)                                                    \
+      for (l = 0; l < KMEANS_LANES; l++) {                                               \
+        difference = x[j] - columns[(size_t) j * k_stride + c + l];                      \
+        sum[l] += difference * difference;                                               \
+      }                                                                                  \
+    for (l = 0; l < KMEANS_LANES; l++)                                                   \
+      distances[c + l] = sum[l];                                                         \
+  }                                                                                      \
+}
+#endif
+DEFINE_DISTANCE_KERNEL(distances_any_d, d)
+DEFINE_DISTANCE_KERNEL(distances_d1, 1)
+DEFINE_DISTANCE_KERNEL(distances_d2, 2)
+DEFINE_DISTANCE_KERNEL(distances_d3, 3)
+DEFINE_DISTANCE_KERNEL(distances_d4, 4)
+DEFINE_DISTANCE_KERNEL(distances_d5, 5)
+DEFINE_DISTANCE_KERNEL(distances_d6, 6)
+DEFINE_DISTANCE_KERNEL(distances_d7, 7)
+DEFINE_DISTANCE_KERNEL(distances_d8, 8)
+
+static DistanceKernel distance_kernel(int d) {
+  static const DistanceKernel small[SMALL_DIMENSIONS + 1] = {
+      distances_any_d, distances_d1, distances_d2, distances_d3, distances_d4,
+      distances_d5, distances_d6, distances_d7, distances_d8};
+  return d <= SMALL_DIMENSIONS ? small[d] : distances_any_d;
+}
+static void transpose_centroids(const double *centroids, int K, int d, int stride, int k_stride,
+                                double columns[]) {
+  int i, j;
+  for (i = 0; i < K; i++)
+    for (j = 0; j < d; j++)
+      columns[(size_t) j * k_stride + i] = centroids[i * stride + j];
+}
+static void add_row(double sums[], const double x[], int stride) {
+  /* sums += x, both aligned and padded */
+  int j = 0;
+#ifdef __AVX2__
+  for (; j < stride; j += KMEANS_LANES)
+    _mm256_store_pd(sums + j, _mm256_add_pd(_mm256_load_pd(sums + j), _mm256_load_pd(x + j)));
+#endif
+  for (; j < stride; j++)
+    sums[j] += x[j];
+}
+static int index_of_closest_cluster(const double distances[], int K, double *closest, double *second) {
+/*
+calculating the index of the closest cluster from the squared distances of
+the data point, the first one on ties. *closest and *second get the
+smallest and the second smallest squared distances.
+*/
+  int j, index = 0;
+  /* minimum initialisation. (the first centroid) */
+  *closest = distances[0];
+  *second = HUGE_VAL;
   /* checks for the rest of the centroids. */
-  for (j = 0; j < K; j++) {
-    sum = 0;
-    for (i = 0; i < d; i++) {
-      sum += pow(x[i] - centroids[j * d + i], 2);
-    }
-    if (sum < min) {
-      min = sum;
+  for (j = 1; j < K; j++) {
+    if (distances[j] < *closest) {
+      *second = *closest;
+      *closest = distances[j];
       index = j;
+    } else if (distances[j] < *second) {
+      *second = distances[j];
     }
   }
   return index;
 }
-static int run(double** data_points, double** centroids_pp, int n, int d, int k, int max_iter, double epsilon) {
+/*
+Hamerly's bounds for the assignment step. upper[i] bounds the distance of
+point i from its centroid from above, lower[i] the distance from any other
+centroid from below, and half_gap[j] is half the distance from centroid j
+to the nearest other one. A point needs no distances computed while
+upper[i] < max(lower[i], half_gap[assignment[i]]). The bounds are widened
+by BOUND_SLACK, far beyond the rounding of the distances, so a skipped
+point is one the full search would have assigned the same way.
+*/
+#define BOUND_SLACK 1e-10
+
+static void compute_half_gaps(const double *centroids, int K, int d, int stride, double half_gap[]) {
+  int i, j;
+  double distance;
+  for (i = 0; i < K; i++)
+    half_gap[i] = HUGE_VAL;
+  for (i = 0; i < K; i++)
+    for (j = i + 1; j < K; j++) {
+      distance = squared_distance(centroids + i * stride, centroids + j * stride, d);
+      if (distance < half_gap[i])
+        half_gap[i] = distance;
+      if (distance < half_gap[j])
+        half_gap[j] = distance;
+    }
+  for (i = 0; i < K; i++)
+    half_gap[i] = 0.5 * sqrt(half_gap[i]) * (1 - BOUND_SLACK);
+}
+/*
+k-means++ seeding. The draws replay numpy's legacy RandomState: MT19937
+seeded by seed(), choice(n) by masked rejection and choice(n, p) by the
+normalized cumulative sum of p. The D^2 weights are summed in numpy's
+pairwise order, so a seed picks the same centroids as np.random.seed(seed)
+followed by the NumPy implementation of the algorithm.
+*/
+#define MT_SIZE 624
+#define MT_SHIFT 397
+
+typedef struct {
+  unsigned long key[MT_SIZE]; /* 32 bit words */
+  int pos;
+} MersenneTwister;
+
+static void mt_seed(MersenneTwister *mt, unsigned long seed) {
+  int i;
+  seed &= 0xffffffffUL;
+  for (i = 0; i < MT_SIZE; i++) {
+    mt->key[i] = seed;
+    seed = (1812433253UL * (seed ^ (seed >> 30)) + i + 1) & 0xffffffffUL;
+  }
+  mt->pos = MT_SIZE;
+}
+static unsigned long mt_twist(unsigned long upper, unsigned long lower,
+                              unsigned long shifted) {
+  unsigned long y = (upper & 0x80000000UL) | (lower & 0x7fffffffUL);
+  return shifted ^ (y >> 1) ^ ((y & 1) ? 0x9908b0dfUL : 0);
+}
+static unsigned long mt_next(MersenneTwister *mt) {
+  /* the next 32 random bits */
+  unsigned long y;
+  int i;
+  if (mt->pos == MT_SIZE) {
+    for (i = 0; i < MT_SIZE; i++)
+      mt->key[i] = mt_twist(mt->key[i], mt->key[(i + 1) % MT_SIZE],
+                            mt->key[(i + MT_SHIFT) % MT_SIZE]);
+    mt->pos = 0;
+  }
+  y = mt->key[mt->pos++];
+  y ^= y >> 11;
+  y ^= (y << 7) & 0x9d2c5680UL;
+  y ^= (y << 15) & 0xefc60000UL;
+  y ^= y >> 18;
+  return y & 0xffffffffUL;
+}
+static double mt_next_double(MersenneTwister *mt) {
+  /* uniform in [0, 1) with 53 random bits */
+  double a = (double) (mt_next(mt) >> 5), b = (double) (mt_next(mt) >> 6);
+  return (a * 67108864.0 + b) / 9007199254740992.0;
+}
+static int mt_below(MersenneTwister *mt, int n) {
+  /* uniform in [0, n): draws masked to the bits of n - 1 until one fits */
+  unsigned long range = (unsigned long) n - 1, mask = range, value;
+  if (range == 0)
+    return 0;
+  mask |= mask >> 1;
+  mask |= mask >> 2;
+  mask |= mask >> 4;
+  mask |= mask >> 8;
+  mask |= mask >> 16;
+  while ((value = mt_next(mt) & mask) > range);
+  return (int) value;
+}
+static double pairwise_sum(const double *a, int n) {
+  /* sum of a in numpy's order: 8 partial sums per block of up to 128 */
+  double r[8], sum = 0;
+  int i, j;
+  if (n < 8) {
+    for (i = 0; i < n; i++)
+      sum += a[i];
+    return sum;
+  }
+  if (n > 128) {
+    i = n / 2;
+    i -= i % 8;
+    return pairwise_sum(a, i) + pairwise_sum(a + i, n - i);
+  }
+  for (j = 0; j < 8; j++)
+    r[j] = a[j];
+  for (i = 8; i < n - n % 8; i += 8)
+    for (j = 0; j < 8; j++)
+      r[j] += a[i + j];
+  sum = ((r[0] + r[1]) + (r[2] + r[3])) + ((r[4] + r[5]) + (r[6] + r[7]));
+  for (; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+static void nearest_update(const double *x, int n, int d, const double *c,
+                           double nearest[], double squares[]) {
+  /* nearest[i] = min(nearest[i], ||x_i - c||^2) */
+  int i, j;
+  const double *row;
+  double distance;
+  for (i = 0; i < n; i++) {
+    row = x + (size_t) i * d;
+    for (j = 0; j < d; j++)
+      squares[j] = (row[j] - c[j]) * (row[j] - c[j]);
+    distance = pairwise_sum(squares, d);
+    if (distance < nearest[i])
+      nearest[i] = distance;
+  }
+}
+static int kmeans_pp(const double *x, int n, int d, int k,
+                     unsigned long seed, int indices[]) {
+  /* k initial centroid indices of the n x d x. 0 if the points left are
+   * all chosen already (the weights are all 0) */
+  MersenneTwister mt;
+  double *nearest, *cdf, *squares, total, u;
+  int i, c, low, high;
+  nearest = malloc((size_t) n * sizeof(double));
+  cdf = malloc((size_t) n * sizeof(double));
+  squares = malloc(((size_t) d + 1) * sizeof(double));
+  assert(nearest != NULL && cdf != NULL && squares != NULL);
+  mt_seed(&mt, seed);
+  indices[0] = mt_below(&mt, n);
+  for (i = 0; i < n; i++)
+    nearest[i] = HUGE_VAL;
+  for (c = 1; c < k; c++) {
+    nearest_update(x, n, d, x + (size_t) indices[c - 1] * d, nearest,
+                   squares);
+    total = pairwise_sum(nearest, n);
+    if (!(total > 0))
+      break;
+    /* p = nearest / total, then its cumulative sum scaled to end in 1 */
+    cdf[0] = nearest[0] / total;
+    for (i = 1; i < n; i++)
+      cdf[i] = cdf[i - 1] + nearest[i] / total;
+    for (i = 0; i < n; i++)
+      cdf[i] /= cdf[n - 1];
+    /* the first index with cdf > u */
+    u = mt_next_double(&mt);
+    for (low = 0, high = n; low < high;) {
+      i = low + (high - low) / 2;
+      if (cdf[i] > u)
+        high = i;
+      else
+        low = i + 1;
+    }
+    indices[c] = low;
+  }
+  free(nearest);
+  free(cdf);
+  free(squares);
+  return c == k;
+}
+/*
+The assignment step runs on a thread pool in blocks of KMEANS_BLOCK points.
+Each block sums its points into its own k x stride slice, and the slices
+are merged in block order, so the centroids do not depend on the number of
+threads and match the serial sums while n <= KMEANS_BLOCK.
+*/
+#define KMEANS_BLOCK 2048
+
+typedef struct {
+  const double *points;    /* n x stride */
+  const double *centroids; /* k x stride */
+  const double *columns;   /* the centroids transposed, d x k_stride */
+  DistanceKernel distances;
+  int n, d, k, stride, k_stride;
+  int *assignment;
+  double *upper, *lower;
+  /* the bounds are used and moved by drift when bounded */
+  int bounded, farthest;
+  const double *half_gap, *drift;
+  double largest, second;
+  double *partial_sums; /* k x stride per block */
+  int *partial_sizes;   /* k per block */
+} AssignmentStep;
+
+static void assign_point(const AssignmentStep *step, int i, double bound, double distances[]) {
+/*
+the closest cluster of point i, searched for only if the bounds do not
+already prove it. bound is max(lower, half_gap) of the current assignment,
+-1 to search unconditionally.
+*/
+  const double *x = step->points + (size_t) i * step->stride;
+  double closest, second;
+  if (step->upper[i] < bound)
+    return;
+  if (bound > 0) {
+    step->upper[i] = sqrt(squared_distance(x, step->centroids + step->assignment[i] * step->stride,
+                                           step->d)) * (1 + BOUND_SLACK);
+    if (step->upper[i] < bound)
+      return;
+  }
+  step->distances(x, step->columns, step->d, step->k_stride, distances);
+  step->assignment[i] = index_of_closest_cluster(distances, step->k, &closest, &second);
+  step->upper[i] = sqrt(closest) * (1 + BOUND_SLACK);
+  step->lower[i] = sqrt(second) * (1 - BOUND_SLACK);
+}
+static void assign_blocks(void *args, int begin, int end) {
+  AssignmentStep *step = (AssignmentStep *) args;
+  int b, i, j, last, index, k = step->k, stride = step->stride;
+  double *sums, *distances, bound;
+  int *sizes;
+  distances = malloc(step->k_stride * sizeof(double));
+  assert(distances != NULL);
+  for (b = begin; b < end; b++) {
+    sums = step->partial_sums + (size_t) b * k * stride;
+    sizes = step->partial_sizes + (size_t) b * k;
+    for (j = 0; j < k * stride; j++)
+      sums[j] = 0;
+    for (j = 0; j < k; j++)
+      sizes[j] = 0;
+    last = (b + 1) * KMEANS_BLOCK < step->n ? (b + 1) * KMEANS_BLOCK : step->n;
+    for (i = b * KMEANS_BLOCK; i < last; i++) {
+      index = step->assignment[i];
+      bound = -1;
+      if (step->bounded) {
+        step->upper[i] = (step->upper[i] + step->drift[index]) * (1 + BOUND_SLACK);
+        step->lower[i] = (step->lower[i] - (index == step->farthest ? step->second : step->largest))
+            * (1 - BOUND_SLACK);
+        bound = step->lower[i] > step->half_gap[index] ? step->lower[i] : step->half_gap[index];
+      }
+      assign_point(step, i, bound, distances);
+      index = step->assignment[i];
+      add_row(sums + index * stride, step->points + (size_t) i * stride, stride);
+      sizes[index]++;
+    }
+  }
+  free(distances);
+}
+static int measure_drift(AssignmentStep *step, const double *old_centroids, double drift[]) {
+/*
+how far every centroid moved, and the two largest moves. 0 if a centroid is
+not a number (an empty cluster), the bounds are then of no use.
+*/
+  int j, stride = step->stride;
+  step->farthest = 0;
+  step->largest = step->second = 0;
+  for (j = 0; j < step->k; j++) {
+    drift[j] = sqrt(squared_distance(step->centroids + j * stride, old_centroids + j * stride, step->d))
+        * (1 + BOUND_SLACK);
+    if (drift[j] != drift[j])
+      return 0;
+    if (drift[j] > step->largest) {
+      step->second = step->largest;
+      step->largest = drift[j];
+      step->farthest = j;
+    } else if (drift[j] > step->second) {
+      step->second = drift[j];
+    }
+  }
+  return 1;
+}
+static void free_run_memory(AssignmentStep *step, double *points, double *centroids,
+                            double *old_centroids, double *clusters, double *columns,
+                            int *sizeof_clusters) {
+  /* the working memory of run(), any of it may be NULL */
+  free(points);
+  free(clusters);
+  free(sizeof_clusters);
+  free(centroids);
+  free(old_centroids);
+  free(columns);
+  free(step->assignment);
+  free(step->upper);
+  free(step->lower);
+  free(step->partial_sums);
+  free(step->partial_sizes);
+  free(step->half_gap);
+  free(step->drift);
+}
+static int run(const double *data_points, double *centroids_pp, int n, int d, int k, int max_iter, double epsilon,
+               int num_threads) {
 /*
 the main clustering algorithm using kmeans.
 same implementation from HW1 except using kmeans++ and data parsing implemented in python.
+data_points is n x d and centroids_pp the k x d initial centroids, replaced by the final ones.
+returns 1, with centroids_pp unchanged, if the working memory could not be allocated.
 */
-  int iteration_num, valid, i, j, t;
-  double *vectors;
+  int iteration_num, valid, i, j, b, num_blocks, stride, k_stride;
+  double *points;
   double *centroids;
   double *old_centroids;
   double *clusters;
+  double *columns;
   int *sizeof_clusters;
-  centroids = calloc(k * d, sizeof(double));
-  vectors = calloc(d * n, sizeof(double));
-  old_centroids = calloc(k * d, sizeof(double));
-  clusters = calloc(k * d, sizeof(double));
+  double *half_gap, *drift;
+  AssignmentStep step;
+  ThreadPool *pool;
+  num_blocks = (n + KMEANS_BLOCK - 1) / KMEANS_BLOCK;
+  stride = ROUND_UP_TO_LANES(d);
+  k_stride = ROUND_UP_TO_LANES(k);
+  points = aligned_matrix(n, stride);
+  centroids = aligned_matrix(k, stride);
+  old_centroids = aligned_matrix(k, stride);
+  clusters = aligned_matrix(k, stride);
+  columns = aligned_matrix(d, k_stride);
   sizeof_clusters = calloc(k, sizeof(int));
+  half_gap = calloc(k, sizeof(double));
+  drift = calloc(k, sizeof(double));
+  step.points = points;
+  step.centroids = centroids;
+  step.columns = columns;
+  step.distances = distance_kernel(d);
+  step.n = n;
+  step.d = d;
+  step.k = k;
+  step.stride = stride;
+  step.k_stride = k_stride;
+  step.assignment = calloc(n, sizeof(int));
+  step.upper = calloc(n, sizeof(double));
+  step.lower = calloc(n, sizeof(double));
+  step.half_gap = half_gap;
+  step.drift = drift;
+  step.partial_sums = aligned_matrix(num_blocks * k, stride);
+  step.partial_sizes = calloc((size_t) num_blocks * k, sizeof(int));
+  if (points == NULL || centroids == NULL || old_centroids == NULL || clusters == NULL
+      || columns == NULL || sizeof_clusters == NULL || half_gap == NULL || drift == NULL
+      || step.assignment == NULL || step.upper == NULL || step.lower == NULL
+      || step.partial_sums == NULL || step.partial_sizes == NULL) {
+    free_run_memory(&step, points, centroids, old_centroids, clusters, columns,
+                    sizeof_clusters);
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    memcpy(points + (size_t) i * stride, data_points + (size_t) i * d, d * sizeof(double));
+  }
+  pool = CreateThreadPool(num_threads);
 
-  // kmeans++ centroids initialization ------------------------------------------------------
-  t = 0;
-  i = 0;
-  j = 0;
-  while (t < d * k) {
-    if (j == d) {
-      j = 0;
-      ++i;
-    }
-    if(i == k) break;
-    centroids[t] = centroids_pp[i][j];
-    ++j;
-    ++t;
+  /* kmeans++ centroids initialization */
+  for (i = 0; i < k; i++) {
+    memcpy(centroids + i * stride, centroids_pp + i * d, d * sizeof(double));
   }
-  // -----------------------------------------------------------------------------------
   iteration_num = 0;
   valid = 1;
+  /* the first iteration, or one after a cluster emptied, searches every point */
+  step.bounded = 0;
   while (iteration_num < max_iter && valid == 1) {
-    for (i = 0; i < k * d; i++) {
-      old_centroids[i] = centroids[i];
-    }
-    for (i = 0; i < n; i++) {
-      int index = index_of_closest_cluster(data_points[i], centroids, k, d);
-      for (j = 0; j < d; j++) {
-        clusters[index * d + j] += data_points[i][j];
+    memcpy(old_centroids, centroids, (size_t) k * stride * sizeof(double));
+    transpose_centroids(centroids, k, d, stride, k_stride, columns);
+    if (step.bounded)
+      compute_half_gaps(centroids, k, d, stride, half_gap);
+    ParallelFor(pool, assign_blocks, &step, num_blocks);
+    /* merge the block sums in block order */
+    for (b = 0; b < num_blocks; b++) {
+      for (j = 0; j < k * stride; j++) {
+        clusters[j] += step.partial_sums[(size_t) b * k * stride + j];
+      }
+      for (j = 0; j < k; j++) {
+        sizeof_clusters[j] += step.partial_sizes[(size_t) b * k + j];
       }
-      sizeof_clusters[index]++;
     }
     for (j = 0; j < k; j++) {
       for (i = 0; i < d; i++) {
-        centroids[d * j + i] = clusters[d * j + i] / sizeof_clusters[j];
+        centroids[stride * j + i] = clusters[stride * j + i] / sizeof_clusters[j];
       }
     }
-    for (j = 0; j < k * d; j++) {
+    for (j = 0; j < k * stride; j++) {
       clusters[j] = 0;
     }
     for (j = 0; j < k; j++) {
       sizeof_clusters[j] = 0;
     }
-    valid = is_converged(centroids, old_centroids, k, d, epsilon);
+    step.bounded = measure_drift(&step, old_centroids, drift);
+    valid = is_converged(centroids, old_centroids, k, d, stride, epsilon);
     iteration_num++;
   }
-  t = 0;
-  i = 0;
-  j = 0;
-  while (t < d * k) {
-    if (j == d) {
-      j = 0;
-      ++i;
-    }
-    if(i == k) break;
-    centroids_pp[i][j] = centroids[t];
-    ++j;
-    ++t;
+  for (i = 0; i < k; i++) {
+    memcpy(centroids_pp + i * d, centroids + i * stride, d * sizeof(double));
   }
-  free(clusters);
-  free(sizeof_clusters);
-  free(centroids);
-  free(old_centroids);
-  free(vectors);
+  DestroyThreadPool(pool);
+  free_run_memory(&step, points, centroids, old_centroids, clusters, columns,
+                  sizeof_clusters);
   return 0;
 }
 /*
 C API code
 */
-static double** get_from_python(int num_of_elements, int dim, PyObject *python_list){
 /*
-parse python list input into 2d array.
+Input matrices: a C contiguous float64 buffer (e.g. a NumPy array) is used
+in place, a list of floats (flat, or a list of rows) is copied.
 */
+typedef struct {
+  Py_buffer view; /* view.obj is NULL for a copied list */
+  double *data;
+} InputMatrix;
+
+static int is_float64(const Py_buffer *view) {
+  const char *format = view->format == NULL ? "B" : view->format;
+  const int one = 1;
+  if (*format == '@' || *format == '='
+      || (*format == '<' && *(const char *) &one == 1))
+    ++format;
+  return view->itemsize == sizeof(double) && !strcmp(format, "d");
+}
+static int convert_object_python_to_c(PyObject *data_points_from_py,
+                                      double data_points_converted_to_c[],
+                                      int n,
+                                      int d) {
+  /* 0 with an exception set if the list does not hold n x d floats */
   int i, j;
-  double **matrix;
-  PyObject *temp_list, *element;
-  matrix = calloc(num_of_elements, sizeof(double*));
-  for (i = 0; i < num_of_elements; i++){
-    matrix[i] = calloc(dim, sizeof(double));
-    temp_list = PyList_GetItem(python_list, i);
-    for (j = 0; j < dim; j++){
-      element = PyList_GetItem(temp_list, j);
-      matrix[i][j] = PyFloat_AsDouble(element);
+  PyObject *row;
+  if (PyList_GET_SIZE(data_points_from_py) == (Py_ssize_t) n * d) {
+    for (i = 0; i < n * d; ++i)
+      data_points_converted_to_c[i] = PyFloat_AsDouble(
+          PyList_GET_ITEM(data_points_from_py, i));
+    return !PyErr_Occurred();
+  }
+  if (PyList_GET_SIZE(data_points_from_py) != n) {
+    PyErr_SetString(PyExc_ValueError, "expected n x d values");
+    return 0;
+  }
+  for (i = 0; i < n; ++i) {
+    row = PyList_GET_ITEM(data_points_from_py, i);
+    if (!PyList_Check(row) || PyList_GET_SIZE(row) != d) {
+      PyErr_SetString(PyExc_ValueError, "expected n rows of d values");
+      return 0;
+    }
+    for (j = 0; j < d; ++j)
+      data_points_converted_to_c[i * d + j] = PyFloat_AsDouble(
+          PyList_GET_ITEM(row, j));
+  }
+  return !PyErr_Occurred();
+}
+static int get_input_matrix(PyObject *object, int n, int d,
+                            InputMatrix *input) {
+  /* 0 with an exception set if object is not an n x d matrix */
+  input->view.obj = NULL;
+  if (n <= 0 || d <= 0) {
+    PyErr_SetString(PyExc_ValueError, "expected n > 0 and d > 0");
+    return 0;
+  }
+  if (PyObject_CheckBuffer(object)) {
+    if (PyObject_GetBuffer(object, &input->view,
+                           PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+      return 0;
+    if (!is_float64(&input->view)
+        || input->view.len != (Py_ssize_t) n * d * (Py_ssize_t) sizeof(double)) {
+      PyBuffer_Release(&input->view);
+      PyErr_SetString(PyExc_ValueError,
+                      "expected a C contiguous float64 buffer of n x d "
+                      "values");
+      return 0;
     }
+    input->data = (double *) input->view.buf;
+    return 1;
   }
-  return matrix;
+  if (!PyList_Check(object)) {
+    PyErr_SetString(PyExc_TypeError, "expected a list or a float64 buffer");
+    return 0;
+  }
+  AllocateMatrix(&input->data, n, d);
+  if (!convert_object_python_to_c(object, input->data, n, d)) {
+    FreeMatrix(&input->data);
+    return 0;
+  }
+  return 1;
+}
+static void release_input_matrix(InputMatrix *input) {
+  if (input->view.obj != NULL)
+    PyBuffer_Release(&input->view);
+  else
+    FreeMatrix(&input->data);
 }
-static PyObject* send_to_python(double** centroids, int K, int dim){
 /*
-send the final centroids to python as a list object.
+Result matrices: a Matrix owns the malloc'd rows x cols result and exposes
+it through the buffer protocol as a 2 dimensional float64 buffer, so
+numpy.asarray(result) is a view of it without any conversion.
 */
-  int i, j;
-  PyObject* outer_list;
-  PyObject* inner_list;
-  PyObject* element;
-  outer_list = PyList_New(K);
-  for (i = 0; i < K; i++){
-    inner_list = PyList_New(dim);
-    for (j = 0; j < dim; j++){
-      element = PyFloat_FromDouble(centroids[i][j]);
-      PyList_SET_ITEM(inner_list, j, element);
-    }
-    PyList_SET_ITEM(outer_list, i, inner_list);
+typedef struct {
+  PyObject_HEAD
+  double *data;
+  Py_ssize_t shape[2], strides[2];
+} MatrixObject;
+
+/* zero filled, the fields are set by init_matrix_type */
+static PyTypeObject MatrixType;
+
+static int matrix_get_buffer(PyObject *object, Py_buffer *view, int flags) {
+  MatrixObject *matrix = (MatrixObject *) object;
+  view->obj = object;
+  Py_INCREF(object);
+  view->buf = matrix->data;
+  view->len = matrix->shape[0] * matrix->shape[1]
+      * (Py_ssize_t) sizeof(double);
+  view->readonly = 0;
+  view->itemsize = sizeof(double);
+  view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+  view->ndim = 2;
+  view->shape = (flags & PyBUF_ND) ? matrix->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES
+                  ? matrix->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+static void matrix_dealloc(PyObject *object) {
+  free(((MatrixObject *) object)->data);
+  Py_TYPE(object)->tp_free(object);
+}
+static PyBufferProcs matrix_buffer_procs = {matrix_get_buffer, NULL};
+
+static int init_matrix_type(void) {
+  /* the object header as PyVarObject_HEAD_INIT makes it, a one element
+   * array is the only complete initializer the macro allows */
+  PyVarObject head[1] = {PyVarObject_HEAD_INIT(NULL, 0)};
+  MatrixType.ob_base = head[0];
+  MatrixType.tp_name = "finalmodule.Matrix";
+  MatrixType.tp_basicsize = sizeof(MatrixObject);
+  MatrixType.tp_dealloc = matrix_dealloc;
+  MatrixType.tp_as_buffer = &matrix_buffer_procs;
+  MatrixType.tp_flags = Py_TPFLAGS_DEFAULT;
+  MatrixType.tp_doc = PyDoc_STR("a rows x cols float64 result, use "
+                                "numpy.asarray() or memoryview() on it");
+  return PyType_Ready(&MatrixType);
+}
+static PyObject *new_matrix(double *data, int rows, int cols) {
+  /* takes ownership of data, which is freed with the Matrix (or now if
+   * the Matrix cannot be created) */
+  MatrixObject *matrix = PyObject_New(MatrixObject, &MatrixType);
+  if (matrix == NULL) {
+    free(data);
+    return NULL;
   }
-  return outer_list;
+  matrix->data = data;
+  matrix->shape[0] = rows;
+  matrix->shape[1] = cols;
+  matrix->strides[0] = (Py_ssize_t) cols * sizeof(double);
+  matrix->strides[1] = sizeof(double);
+  return (PyObject *) matrix;
 }
 static PyObject* fit_kmeans(PyObject *self, PyObject *args) {
 /*
 the algorithm's fit() function. calls run() and return the output back to python.
 */
   PyObject *output, *data_points_list, *centroid_list;
-  int N, K, max_iter, dim;
-  double **centroids, **data_points;
+  InputMatrix data_points_input, centroids_input;
+  int N, K, max_iter, dim, failed, num_threads = 1;
+  double *centroids_copy;
   double epsilon;
-  if (!PyArg_ParseTuple(args, "iiiidOO", &N, &K, &max_iter, &dim, &epsilon,
-                        &centroid_list, &data_points_list)){
+  if (!PyArg_ParseTuple(args, "iiiidOO|i", &N, &K, &max_iter, &dim, &epsilon,
+                        &centroid_list, &data_points_list, &num_threads)){
     return NULL;
   }
-  data_points = get_from_python(N, dim, data_points_list);
-  centroids = get_from_python(K, dim, centroid_list);
-  if (run(data_points, centroids, N, dim, K, max_iter, epsilon))
-  {
-    free_2d_arr(data_points, N);
-    free_2d_arr(centroids, K);
+  if (!get_input_matrix(data_points_list, N, dim, &data_points_input))
+    return NULL;
+  if (!get_input_matrix(centroid_list, K, dim, &centroids_input)) {
+    release_input_matrix(&data_points_input);
     return NULL;
   }
-  else {
-    output = send_to_python(centroids, K, dim);
-    free_2d_arr(data_points, N);
-    free_2d_arr(centroids, K);
-    return output;
+  /* run() moves the centroids, never the caller's buffer */
+  AllocateMatrix(&centroids_copy, K, dim);
+  CopyMatrix(centroids_copy, centroids_input.data, K, dim);
+  release_input_matrix(&centroids_input);
+  Py_BEGIN_ALLOW_THREADS
+  failed = run(data_points_input.data, centroids_copy, N, dim, K, max_iter, epsilon, num_threads);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points_input);
+  if (failed) {
+    FreeMatrix(&centroids_copy);
+    return PyErr_NoMemory();
   }
+  output = new_matrix(centroids_copy, K, dim);
+  return output;
 }
 /*
 C API code spectral clustering
 */
 
-static void convert_object_python_to_c(PyObject *data_points_from_py,
-                                       double data_points_converted_to_c[],
-                                       int n,
-                                       int d) {
-  int i, j;
+/*
+The computations below run without the GIL: they touch no Python object,
+the input is either a copy or a buffer whose exporter stays locked until
+release_input_matrix(), and the library keeps no state outside the Nsc.
+Results are unpacked into the full matrices of the Matrix objects there
+too.
+*/
+static double *unpack_symmetric(const double *packed, int n) {
+  /* the full n x n matrix of a packed symmetric matrix */
+  double *full;
+  AllocateMatrix(&full, n, n);
+  UnpackSymmetricMatrix(full, packed, n);
+  return full;
+}
+
+static double *unpack_diagonal(const double *diagonal, int n) {
+  /* the full n x n matrix diag(diagonal) */
+  int i;
+  double *full;
+  AllocateMatrix(&full, n, n);
   for (i = 0; i < n; ++i)
-    for (j = 0; j < d; ++j) {
-      data_points_converted_to_c[i * d + j] = PyFloat_AsDouble(
-          PyList_GetItem(data_points_from_py, i * d + j));
-    }
+    full[(size_t) i * n + i] = diagonal[i];
+  return full;
 }
 
-static PyObject *convert_object_c_to_python(double *matrix, int n, int d) {
-  int i, j;
-  PyObject * pyMatrix;
-  pyMatrix = PyList_New(n * d);
-  for (i = 0; i < n; ++i) {
-    for (j = 0; j < d; ++j) {
-      PyList_SET_ITEM(pyMatrix, i * d + j,
-                      PyFloat_FromDouble(matrix[i * d + j]));
-    }
+static double *unpack_sparse(const SparseMatrix *matrix) {
+  /* the full n x n matrix of a sparse matrix */
+  int i, n = matrix->n;
+  size_t e;
+  double *full;
+  AllocateMatrix(&full, n, n);
+  for (i = 0; i < n; ++i)
+    for (e = matrix->row_start[i]; e < matrix->row_start[i + 1]; ++e)
+      full[(size_t) i * n + matrix->columns[e]] = matrix->values[e];
+  return full;
+}
+
+static void set_graph(Nsc *nsc, int num_neighbours, double cutoff) {
+  /* dense unless num_neighbours > 0 (k nearest) or cutoff > 0 */
+  if (num_neighbours > 0) {
+    nsc->graph = KNN_GRAPH;
+    nsc->num_neighbours = num_neighbours;
+  } else if (cutoff > 0) {
+    nsc->graph = CUTOFF_GRAPH;
+    nsc->cutoff = cutoff;
   }
-  return pyMatrix;
+}
+
+/* The optional arguments of fit() and spk() */
+typedef struct {
+  int eigen_solver, num_threads, num_neighbours, num_landmarks,
+      landmark_sampling;
+  double cutoff;
+} FitOptions;
+
+static double *calculate_t(const double *data_points, int n, int d,
+                           const FitOptions *options, int *k) {
+  /* the n x k T matrix, *k = 0 is replaced by the eigengap heuristic's.
+   * NULL if the eigensolver did not converge */
+  Nsc nsc;
+  double *t, *u;
+  /* Initialize the Nsc object */
+  ConstructNsc(&nsc, data_points, n, d, FIT);
+  nsc.eigen_solver = (EigenSolver) options->eigen_solver;
+  nsc.num_threads = options->num_threads;
+  set_graph(&nsc, options->num_neighbours, options->cutoff);
+  nsc.num_landmarks = options->num_landmarks;
+  nsc.landmark_sampling = (LandmarkSampling) options->landmark_sampling;
+  nsc.k = *k; /* the partial eigensolver computes only what FindK needs */
+  /* Preform the spectral clustering steps, l_norm is pulled in unless
+   * the Nystrom approximation replaces it */
+  CalculateEigenpairs(&nsc);
+  if (nsc.num_eigen == 0) {
+    DestructNsc(&nsc);
+    return NULL;
+  }
+  /* Calculates k and sorts eigen_vectors and eigen_values */
+  *k = FindK(&nsc, *k);
+  AllocateMatrix(&u, n, *k);
+  AllocateMatrix(&t, n, *k);
+  CalculateUMatrix(&nsc, u, *k);
+  CalculateTMatrix(u, t, n, *k);
+  /* Memory de-allocation */
+  FreeMatrix(&u);
+  DestructNsc(&nsc);
+  return t;
 }
 
 static PyObject *fit(PyObject *self, PyObject *args) {
   /* Declarations */
-  Nsc nsc;
-  PyObject *empty_list, *data_points_from_python,
-  *result_for_python = PyTuple_New(2);
-  double *data_points_converted_to_c, *t, *u;
+  FitOptions options = {CLASSIC_JACOBI, 1, 0, 0, UNIFORM_LANDMARKS, 0};
+  PyObject *empty_list, *data_points_from_python, *result_for_python;
+  InputMatrix data_points;
+  double *t;
   int n, d, k;
   /* Parsing arguments */
   if (!PyArg_ParseTuple(args,
-                        "Oiii",
+                        "Oiii|iiidii",
                         &data_points_from_python,
                         &n,
                         &d,
-                        &k)) {
+                        &k,
+                        &options.eigen_solver,
+                        &options.num_threads,
+                        &options.num_neighbours,
+                        &options.cutoff,
+                        &options.num_landmarks,
+                        &options.landmark_sampling)) {
     empty_list = PyList_New(0);
     return empty_list;
   }
-  if (!PyList_Check(data_points_from_python)) {
-    empty_list = PyList_New(0);
-    return empty_list;
+  /* Data points, used in place if possible */
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  t = calculate_t(data_points.data, n, d, &options, &k);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  if (t == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "the eigensolver did not converge");
+    return NULL;
   }
-  /* Memory allocation */
-  AllocateMatrix(&data_points_converted_to_c, n, d);
-  /* Data points conversion */
-  convert_object_python_to_c(data_points_from_python,
-                             data_points_converted_to_c, n, d);
-  /* Initialize the Nsc object */
-  ConstructNsc(&nsc, data_points_converted_to_c, n, d, FIT);
-  /* Preform the spectral clustering steps */
-  CalculateNormalizedGraphLaplacian(&nsc);
-  CalculateJacobi(&nsc);
-  /* Calculates k and sorts eigen_vectors and eigen_values */
-  k = FindK(&nsc, k);
-  AllocateMatrix(&u, n, k);
-  AllocateMatrix(&t, n, k);
-  CalculateUMatrix(&nsc, u, k);
-  CalculateTMatrix(u, t, n, k);
   /* Convert output to a python object */
-  PyTuple_SetItem(result_for_python, 0,
-                  convert_object_c_to_python(t, n, k));
+  result_for_python = PyTuple_New(2);
+  PyTuple_SetItem(result_for_python, 0, new_matrix(t, n, k));
   PyTuple_SetItem(result_for_python, 1, PyLong_FromLong(k));
-  /* Memory de-allocation */
-  FreeMatrix(&data_points_converted_to_c);
-  FreeMatrix(&u);
-  FreeMatrix(&t);
-  DestructNsc(&nsc);
   /* Return the computed t matrix as a python object */
   return result_for_python;
 }
 
+static PyObject *convert_indices_c_to_python(const int *indices, int k) {
+  int i;
+  PyObject *list = PyList_New(k);
+  for (i = 0; i < k; ++i)
+    PyList_SET_ITEM(list, i, PyLong_FromLong(indices[i]));
+  return list;
+}
+
+static PyObject *spk(PyObject *self, PyObject *args) {
+  /*
+  the whole spk goal: T, its k-means++ centroid indices and the final
+  centroids, without returning to python in between. None if k is not
+  in (1, n)
+  */
+  FitOptions options = {CLASSIC_JACOBI, 1, 0, 0, UNIFORM_LANDMARKS, 0};
+  PyObject *data_points_from_python;
+  InputMatrix data_points;
+  double *t, *centroids = NULL, epsilon = 0;
+  int n, d, k, i, max_iter = 300, solved, valid, seeded = 0, failed = 0,
+      *indices = NULL;
+  unsigned long seed = 0;
+  if (!PyArg_ParseTuple(args, "Oiii|iiidiiidk", &data_points_from_python,
+                        &n, &d, &k, &options.eigen_solver,
+                        &options.num_threads, &options.num_neighbours,
+                        &options.cutoff, &options.num_landmarks,
+                        &options.landmark_sampling, &max_iter, &epsilon,
+                        &seed))
+    return NULL;
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  t = calculate_t(data_points.data, n, d, &options, &k);
+  solved = t != NULL;
+  valid = solved && 1 < k && k < n;
+  if (valid) {
+    indices = calloc(k, sizeof(int));
+    assert(indices != NULL);
+    seeded = kmeans_pp(t, n, k, k, seed, indices);
+  }
+  if (seeded) {
+    AllocateMatrix(&centroids, k, k);
+    for (i = 0; i < k; ++i)
+      CopyMatrix(centroids + (size_t) i * k, t + (size_t) indices[i] * k,
+                 1, k);
+    failed = run(t, centroids, n, k, k, max_iter, epsilon,
+                 options.num_threads);
+  }
+  FreeMatrix(&t);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  if (!solved) {
+    PyErr_SetString(PyExc_RuntimeError, "the eigensolver did not converge");
+    return NULL;
+  }
+  if (!valid)
+    Py_RETURN_NONE;
+  if (!seeded) {
+    free(indices);
+    PyErr_SetString(PyExc_ValueError, "fewer than k distinct points");
+    return NULL;
+  }
+  if (failed) {
+    free(indices);
+    FreeMatrix(&centroids);
+    return PyErr_NoMemory();
+  }
+  data_points_from_python = convert_indices_c_to_python(indices, k);
+  free(indices);
+  return Py_BuildValue("(NN)", data_points_from_python,
+                       new_matrix(centroids, k, k));
+}
+
+static PyObject *kmeans_pp_seeding(PyObject *self, PyObject *args) {
+  /* the k-means++ centroid indices of the n x d data points */
+  PyObject *data_points_from_python, *result;
+  InputMatrix data_points;
+  int n, d, k, seeded, *indices;
+  unsigned long seed = 0;
+  if (!PyArg_ParseTuple(args, "Oiii|k", &data_points_from_python, &n, &d, &k,
+                        &seed))
+    return NULL;
+  if (k < 1 || k > n) {
+    PyErr_SetString(PyExc_ValueError, "expected 1 <= k <= n");
+    return NULL;
+  }
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  indices = calloc(k, sizeof(int));
+  assert(indices != NULL);
+  Py_BEGIN_ALLOW_THREADS
+  seeded = kmeans_pp(data_points.data, n, d, k, seed, indices);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  if (!seeded) {
+    free(indices);
+    PyErr_SetString(PyExc_ValueError, "fewer than k distinct points");
+    return NULL;
+  }
+  result = convert_indices_c_to_python(indices, k);
+  free(indices);
+  return result;
+}
+
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "UnusedParameter"
 static PyObject *compute_wam(PyObject *self, PyObject *args) {
 #pragma clang diagnostic pop
   /* Declarations */
   Nsc nsc;
-  int n, d;
-  double *data_points_converted_to_c;
+  int n, d, num_threads = 1, num_neighbours = 0;
+  double cutoff = 0;
+  InputMatrix data_points;
+  double *result;
   /* Parsing arguments */
   PyObject * data_points_from_python, *result_for_python, *empty_list;
-  if (!PyArg_ParseTuple(args, "Oii", &data_points_from_python, &n, &d)) {
-    empty_list = PyList_New(0);
-    return empty_list;
-  }
-  if (!PyList_Check(data_points_from_python)) {
+  if (!PyArg_ParseTuple(args, "Oii|iid", &data_points_from_python, &n, &d,
+                        &num_threads, &num_neighbours, &cutoff)) {
     empty_list = PyList_New(0);
     return empty_list;
   }
-  /* Memory allocation */
-  AllocateMatrix(&data_points_converted_to_c, n, d);
-  /* Conversion python to c and initialization of data structure */
-  convert_object_python_to_c(data_points_from_python,
-                             data_points_converted_to_c,
-                             n,
-                             d);
-  ConstructNsc(&nsc, data_points_converted_to_c, n, d, WAM);
+  /* Data points, used in place if possible */
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  ConstructNsc(&nsc, data_points.data, n, d, WAM);
+  nsc.num_threads = num_threads;
+  set_graph(&nsc, num_neighbours, cutoff);
   /* Algorithm calculation */
   CalculateWeightedAdjacencyMatrix(&nsc);
-  /* Conversion c to python */
-  result_for_python = convert_object_c_to_python(nsc.wam, n, n);
+  if (nsc.graph != DENSE_GRAPH)
+    result = unpack_sparse(nsc.sparse_wam);
+  else
+    result = unpack_symmetric(nsc.wam, n);
   /* Memory de-allocation */
-  FreeMatrix(&data_points_converted_to_c);
   DestructNsc(&nsc);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  /* Conversion c to python */
+  result_for_python = new_matrix(result, n, n);
   /* Return */
   return result_for_python;
 }
 
 static PyObject *compute_ddg(PyObject *self, PyObject *args) {
   /* Declarations */
-  int n, d;
+  int n, d, num_threads = 1, num_neighbours = 0;
+  double cutoff = 0;
   Nsc nsc;
-  double *data_points_converted_to_c;
+  InputMatrix data_points;
+  double *result;
   PyObject * data_points_from_python, *result_for_python, *empty_list;
   /* Parsing arguments */
-  if (!PyArg_ParseTuple(args, "Oii", &data_points_from_python, &n, &d)) {
-    empty_list = PyList_New(0);
-    return empty_list;
-  }
-  if (!PyList_Check(data_points_from_python)) {
+  if (!PyArg_ParseTuple(args, "Oii|iid", &data_points_from_python, &n, &d,
+                        &num_threads, &num_neighbours, &cutoff)) {
     empty_list = PyList_New(0);
     return empty_list;
   }
-  /* Memory allocation */
-  AllocateMatrix(&data_points_converted_to_c, n, d);
-  /* Conversion python to c and initialization of data structure */
-  convert_object_python_to_c(
-      data_points_from_python, data_points_converted_to_c, n, d);
-  ConstructNsc(&nsc, data_points_converted_to_c, n, d, DDG);
+  /* Data points, used in place if possible */
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  ConstructNsc(&nsc, data_points.data, n, d, DDG);
+  nsc.num_threads = num_threads;
+  set_graph(&nsc, num_neighbours, cutoff);
   /* Algorithm calculation */
   CalculateDiagonalDegreeMatrix(&nsc);
-  /* Conversion c to python */
-  result_for_python = convert_object_c_to_python(nsc.ddg, n, n);
+  result = unpack_diagonal(nsc.ddg, n);
   /* Memory de-allocation */
-  FreeMatrix(&data_points_converted_to_c);
   DestructNsc(&nsc);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  /* Conversion c to python */
+  result_for_python = new_matrix(result, n, n);
   /* Return */
   return result_for_python;
 }
@@ -365,33 +1064,36 @@ static PyObject *compute_ddg(PyObject *self, PyObject *args) {
 static PyObject *compute_lnorm(PyObject *self, PyObject *args) {
   /* Declarations */
   Nsc nsc;
-  int n, d;
+  int n, d, num_threads = 1, num_neighbours = 0;
+  double cutoff = 0;
   PyObject * data_points_from_python, *result_for_python, *empty_list;
-  double *data_points_converted_to_c;
+  InputMatrix data_points;
+  double *result;
   /* Parsing arguments */
-  if (!PyArg_ParseTuple(args, "Oii", &data_points_from_python, &n, &d)) {
-    empty_list = PyList_New(0);
-    return empty_list;
-  }
-  if (!PyList_Check(data_points_from_python)) {
+  if (!PyArg_ParseTuple(args, "Oii|iid", &data_points_from_python, &n, &d,
+                        &num_threads, &num_neighbours, &cutoff)) {
     empty_list = PyList_New(0);
     return empty_list;
   }
-  /* Memory allocation */
-  AllocateMatrix(&data_points_converted_to_c, n, d);
-  /* Conversion python to c and initialization of data structure */
-  convert_object_python_to_c(data_points_from_python,
-                             data_points_converted_to_c,
-                             n,
-                             d);
-  ConstructNsc(&nsc, data_points_converted_to_c, n, d, LNORM);
+  /* Data points, used in place if possible */
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  ConstructNsc(&nsc, data_points.data, n, d, LNORM);
+  nsc.num_threads = num_threads;
+  set_graph(&nsc, num_neighbours, cutoff);
   /* Algorithm calculation */
   CalculateNormalizedGraphLaplacian(&nsc);
-  /* Conversion c to python */
-  result_for_python = convert_object_c_to_python(nsc.l_norm, n, n);
+  if (nsc.graph != DENSE_GRAPH)
+    result = unpack_sparse(nsc.sparse_l_norm);
+  else
+    result = unpack_symmetric(nsc.l_norm, n);
   /* Memory de-allocation */
-  FreeMatrix(&data_points_converted_to_c);
   DestructNsc(&nsc);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  /* Conversion c to python */
+  result_for_python = new_matrix(result, n, n);
   /* Return */
   return result_for_python;
 }
@@ -399,35 +1101,42 @@ static PyObject *compute_lnorm(PyObject *self, PyObject *args) {
 static PyObject *compute_jacobi(PyObject *self, PyObject *args) {
   /* Declarations */
   Nsc nsc;
-  int n, d;
+  int n, d, eigen_solver = CLASSIC_JACOBI, num_threads = 1, num_eigen;
   PyObject * data_points_from_python, *result_for_python, *empty_list;
-  double *data_points_converted_to_c, *jacobi_result;
+  InputMatrix data_points;
+  double *jacobi_result = NULL;
   /* Parsing arguments */
-  if (!PyArg_ParseTuple(args, "Oii", &data_points_from_python, &n, &d)) {
-    empty_list = PyList_New(0);
-    return empty_list;
-  }
-  if (!PyList_Check(data_points_from_python)) {
+  if (!PyArg_ParseTuple(args, "Oii|ii", &data_points_from_python, &n, &d,
+                        &eigen_solver, &num_threads)) {
     empty_list = PyList_New(0);
     return empty_list;
   }
-  /* Memory allocation */
-  AllocateMatrix(&data_points_converted_to_c, n, d);
-  AllocateMatrix(&jacobi_result, n + 1, n);
-  /* Conversion python to c and initialization of data structure */
-  convert_object_python_to_c(data_points_from_python,
-                             data_points_converted_to_c, n, d);
-  ConstructNsc(&nsc, data_points_converted_to_c, n, d, JACOBI);
+  /* Data points, used in place if possible */
+  if (!get_input_matrix(data_points_from_python, n, d, &data_points))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  ConstructNsc(&nsc, data_points.data, n, d, JACOBI);
+  nsc.eigen_solver = (EigenSolver) eigen_solver;
+  nsc.num_threads = num_threads;
   /* Algorithm calculation */
-  CalculateJacobi(&nsc);
-  CopyMatrix(jacobi_result, nsc.eigen_values, 1, d);
-  CopyMatrix(&jacobi_result[d], nsc.eigen_vectors, n, n);
-  /* Conversion c to python */
-  result_for_python = convert_object_c_to_python(jacobi_result, n + 1, n + 1);
+  CalculateEigenpairs(&nsc);
+  /* eigenvalues row followed by the n x num_eigen eigenvectors */
+  num_eigen = nsc.num_eigen;
+  if (num_eigen > 0) {
+    AllocateMatrix(&jacobi_result, n + 1, num_eigen);
+    CopyMatrix(jacobi_result, nsc.eigen_values, 1, num_eigen);
+    CopyMatrix(&jacobi_result[num_eigen], nsc.eigen_vectors, n, num_eigen);
+  }
   /* Memory de-allocation */
-  FreeMatrix(&data_points_converted_to_c);
-  FreeMatrix(&jacobi_result);
   DestructNsc(&nsc);
+  Py_END_ALLOW_THREADS
+  release_input_matrix(&data_points);
+  if (num_eigen == 0) {
+    PyErr_SetString(PyExc_RuntimeError, "the eigensolver did not converge");
+    return NULL;
+  }
+  /* Conversion c to python */
+  result_for_python = new_matrix(jacobi_result, n + 1, num_eigen);
   /* Return */
   return result_for_python;
 }
@@ -440,6 +1149,10 @@ static PyMethodDef myMethods[] = {
                                                                     "kmeans "
                                                                     "algorithem"
                                                                     "") },
+    {"spk", (PyCFunction) spk, METH_VARARGS,
+     PyDoc_STR("the spk goal: centroid indices and final centroids")},
+    {"kmeans_pp", (PyCFunction) kmeans_pp_seeding, METH_VARARGS,
+     PyDoc_STR("k-means++ initial centroid indices")},
     {"compute_wam", (PyCFunction) compute_wam, METH_VARARGS,
      PyDoc_STR("wam method")},
     {"compute_ddg", (PyCFunction) compute_ddg, METH_VARARGS,
@@ -461,5 +1174,21 @@ static struct PyModuleDef finalmodule = {
 
 PyMODINIT_FUNC
 PyInit_finalmodule(void) {
-  return PyModule_Create(&finalmodule);
+  PyObject *module;
+  if (init_matrix_type() < 0)
+    return NULL;
+  module = PyModule_Create(&finalmodule);
+  if (module == NULL)
+    return NULL;
+  Py_INCREF(&MatrixType);
+  PyModule_AddObject(module, "Matrix", (PyObject *) &MatrixType);
+  /* eigen_solver values for fit() and compute_jacobi() */
+  PyModule_AddIntConstant(module, "CLASSIC_JACOBI", CLASSIC_JACOBI);
+  PyModule_AddIntConstant(module, "CYCLIC_JACOBI", CYCLIC_JACOBI);
+  PyModule_AddIntConstant(module, "HOUSEHOLDER_QL", HOUSEHOLDER_QL);
+  PyModule_AddIntConstant(module, "LANCZOS", LANCZOS);
+  /* landmark_sampling values for fit() */
+  PyModule_AddIntConstant(module, "UNIFORM_LANDMARKS", UNIFORM_LANDMARKS);
+  PyModule_AddIntConstant(module, "KMEANS_PP_LANDMARKS", KMEANS_PP_LANDMARKS);
+  return module;
 }
@@ -47,6 +47,10 @@ function regular_test() {
 		echo -e "\n\e[4;37mTesting correct outputs for the interface of \e[4;33m\e[1;33mC\e[0m:"
 		echo -e "\n\e[4;34m\e[1;34mRESULTS\e[0m"
 		test_interface c
+		if [[ $regular == "yes" ]]; then
+			test_formats c
+			test_eigensolvers c
+		fi
 		
 		buffer
 	fi
@@ -73,6 +77,11 @@ function regular_test() {
 		echo -e "\e[4;37mTesting correct outputs for the interface of \e[4;33m\e[1;33mPython\e[0m:"
 		echo -e "\n\e[4;34m\e[1;34mRESULTS\e[0m"
 		test_interface py
+		if [[ $regular == "yes" ]]; then
+			test_formats py
+			test_eigensolvers py
+			test_threads
+		fi
 		
 		buffer
 	fi
@@ -80,6 +89,29 @@ function regular_test() {
 }
 
 
+# =================
+# NATIVE TEST
+# =================
+function native_test() {
+	# the AVX2/FMA kernels are only compiled with NSC_NATIVE=1, so the regular tests are run again on such a build
+	if ! grep -qw avx2 /proc/cpuinfo || ! grep -qw fma /proc/cpuinfo; then
+		echo -e "This CPU has no AVX2/FMA, skipping the \`NSC_NATIVE=1\` build\n"
+		return
+	fi
+	echo -e "\e[4;37mRebuilding with \e[4;33m\e[1;33mNSC_NATIVE=1\e[0m\e[4;37m (AVX2/FMA kernels):\e[0m\n"
+	build NSC_NATIVE=1
+
+	# only the outputs are checked, the transcripts go to a separate directory
+	local results_dir=$results_dir/native
+	local leaks="no"
+	mkdir $results_dir &> /dev/null
+	regular_test
+
+	build NSC_NATIVE=0
+}
+
+
+
 # comprehensive interface test - specific interface only
 function test_interface() {
 	# the first argument shall be the interface being tested
@@ -125,6 +157,170 @@ function test_goal() {
 
 
 
+# input format test - specific interface only
+function test_formats() {
+	# the first argument shall be the interface being tested: c/py
+	# every input here holds the same values as a regular test file, so its output is the output of that file
+	formats=$testers_path/formats
+
+	if [[ $1 == "c" ]]; then
+		# CRLF line endings, blank lines and no final newline, the points of spk_0.txt
+		for goal in wam ddg lnorm; do
+			format_test c $goal $formats/quirks.txt spk_0.txt ./spkmeans $goal $formats/quirks.txt
+		done
+
+		# a row with a missing value: its file and line on stderr, then "Invalid Input!" and exit code 1
+		echo -n "C: MALFORMED: ${formats}/malformed.txt: "
+		./spkmeans wam $formats/malformed.txt > $output_file 2> ./tmp/error.txt
+		exit_code=$?
+		diff_result=$(diff <(cat ./tmp/error.txt $output_file; echo; echo "exit code $exit_code") <(echo "${formats}/malformed.txt:4: expected 3 comma separated numbers"; echo "Invalid Input!"; echo "exit code 1") 2>&1)
+		verdict_diff ${#diff_result}
+		if [[ ${#diff_result} -ne 0 ]]; then
+			echo -e "DIFF RESULT FOR: c: malformed: malformed.txt:\n${diff_result}\n\n" >> $results_dir/test_transcript_c.txt
+		fi
+		echo
+	fi
+
+	# the binary format of nscdata.py, points.nsc holds spk_0.txt and matrix.nsc holds jacobi_0.txt
+	for goal in wam ddg lnorm; do
+		format_test $1 $goal $formats/points.nsc spk_0.txt $(format_command $1 $goal) $formats/points.nsc
+	done
+	if [[ $1 == "py" ]]; then
+		format_test py spk $formats/points.nsc spk_0.txt $(format_command py spk) $formats/points.nsc
+	fi
+	format_test $1 jacobi $formats/matrix.nsc jacobi_0.txt $(format_command $1 jacobi) $formats/matrix.nsc
+
+	# --stream prints the same bytes in blocks of rows, 5 rows leave a partial last block
+	if [[ $1 == "c" ]]; then
+		for (( i = 0; i <= $spk; i++ )); do
+			for goal in wam ddg lnorm; do
+				format_test c $goal "${testers_path}/spk_${i}.txt --stream=5" spk_$i.txt ./spkmeans $goal $testers_path/spk_$i.txt --stream=5
+			done
+		done
+		format_test c lnorm "${testers_path}/spk_${spk}.txt --stream" spk_$spk.txt ./spkmeans lnorm $testers_path/spk_$spk.txt --stream
+	fi
+}
+
+
+
+# eigensolver test - specific interface only
+function test_eigensolvers() {
+	# the first argument shall be the interface being tested: c/py
+	# --eigen lanczos must find the eigenpairs of the classic outputs: their largest eigenvalues in decreasing order and
+	# each eigenvector inside its eigenspace (signs and the order of the columns may differ), and spk must pick the
+	# same k and initial centroids. spk is only checked on inputs small enough for the 100 rotations of classic to converge
+	for (( i = 0; i <= $jacobi; i++ )); do
+		eigen_test $1 jacobi jacobi_$i.txt
+	done
+	if [[ $1 == "py" ]]; then
+		for (( i = 0; i <= $spk; i++ )); do
+			if [[ $(grep -c . $testers_path/spk_$i.txt) -le 10 ]]; then
+				eigen_test py spk spk_$i.txt $i
+			fi
+		done
+
+		# a KNN graph of two identical, far apart components, whose eigenvalues all come in pairs
+		graphs=$testers_path/graphs
+		format_test py spk "${graphs}/knn_disconnected.txt --knn 5" knn_disconnected.txt python3 -E spkmeans.py 0 spk $graphs/knn_disconnected.txt --knn 5
+	fi
+}
+
+
+
+# one partial eigensolver test
+function eigen_test() {
+	# the first argument shall be the interface being tested: c/py
+	# the second argument shall be the goal being tested: jacobi/spk
+	# the third argument shall be the input file being used
+	# the fourth argument shall be the input file index, for its k
+	echo -n "${1^^}: ${2^^}: ${testers_path}/${3} --eigen lanczos: "
+	if [[ $1 == "c" ]]; then
+		./spkmeans $2 $testers_path/$3 --eigen=lanczos &> $output_file
+	else
+		python3 -E spkmeans.py ${k_array[${4:-0}]} $2 $testers_path/$3 --eigen lanczos &> $output_file
+	fi
+	diff_result=$(echo 'import sys
+def read(name):
+	return [[float(x) for x in line.split(",")] for line in open(name) if line.strip()]
+goal, result, expected = sys.argv[1], read(sys.argv[2]), read(sys.argv[3])
+if goal == "spk":
+	same = len(result) == len(expected) and result[0] == expected[0]
+else:
+	# the largest eigenvalues, in decreasing order
+	largest = sorted(expected[0], reverse=True)[:len(result[0])]
+	same = len(result) == len(expected) and all(abs(x - y) < 1e-3 for x, y in zip(result[0], largest))
+	for l, value in enumerate(result[0]):
+		# the projection of the eigenvector on the expected eigenspace of its eigenvalue has norm 1
+		space = [c for c, other in enumerate(expected[0]) if abs(other - value) < 1e-3]
+		norm = sum(sum(row[l] * erow[c] for row, erow in zip(result[1:], expected[1:])) ** 2 for c in space)
+		same = same and len(space) > 0 and abs(norm - 1) < 1e-2
+if not same:
+	print("".join(open(sys.argv[2])))' | python3 - $2 $output_file $testers_path/outputs/$1/$2/$3 2>&1)
+	verdict_diff ${#diff_result}
+	if [[ ${#diff_result} -ne 0 ]]; then
+		echo -e "DIFF RESULT FOR: ${1}: ${2}: ${3} --eigen lanczos:\n${diff_result}\n\n" >> $results_dir/test_transcript_$1.txt
+	fi
+	echo
+}
+
+
+
+# thread count test - python interface only
+function test_threads() {
+	# k-means sums the points in blocks of 2048 and merges the blocks in order, so with more points than one block
+	# spk must print the same with any --threads. the 3000 points are generated, 3 blobs of the same seed every run
+	echo 'import random
+generator = random.Random(2048)
+for i in range(3000):
+	center = i % 3 * 10
+	print("%.4f,%.4f" % (center + generator.random(), center + generator.random()))' | python3 > ./tmp/threads.txt
+	python3 -E spkmeans.py 3 spk ./tmp/threads.txt --threads 1 &> ./tmp/threads_1.txt
+	for threads in 3 4; do
+		echo -n "PY: SPK: 3000 points --threads ${threads}: "
+		python3 -E spkmeans.py 3 spk ./tmp/threads.txt --threads $threads &> $output_file
+		diff_result=$(diff $output_file ./tmp/threads_1.txt 2>&1)
+		verdict_diff ${#diff_result}
+		if [[ ${#diff_result} -ne 0 ]]; then
+			echo -e "DIFF RESULT FOR: py: spk: 3000 points --threads ${threads}:\n${diff_result}\n\n" >> $results_dir/test_transcript_py.txt
+		fi
+		echo
+	done
+}
+
+
+
+function format_command() {
+	# the first argument shall be the interface being tested: c/py
+	# the second argument shall be the goal, prints the command without its input file
+	if [[ $1 == "c" ]]; then
+		echo "./spkmeans $2"
+	else
+		echo "python3 -E spkmeans.py 0 $2"
+	fi
+}
+
+
+
+# one input format test
+function format_test() {
+	# the first argument shall be the interface being tested: c/py
+	# the second argument shall be the goal being tested
+	# the third argument shall be the name of the test
+	# the fourth argument shall be the regular test file with the same output
+	# the remaining arguments shall be the command to run
+	echo -n "${1^^}: ${2^^}: ${3}: "
+	"${@:5}" &> $output_file
+	diff_result=$(diff $output_file $testers_path/outputs/$1/$2/$4 2>&1)
+	verdict_diff ${#diff_result}
+	if [[ ${#diff_result} -ne 0 ]]; then
+		echo -e "DIFF RESULT FOR: ${1}: ${2}: ${3}:\n${diff_result}\n\n" >> $results_dir/test_transcript_$1.txt
+	fi
+	echo
+}
+
+
+
+
 # invidividual test - specific input file, specific goal, specific interface only
 function individual_test() {
 	# the first argument shall be the interface being tested: c/py
@@ -375,13 +571,10 @@ function test_efficiency_goal() {
 # =================
 # Organizer
 # =================
-function comprehensive_test() {
-
-	mkdir ./tmp &> /dev/null
-
-	# Trying to build the necessary resources
+function build() {
+	# the first argument shall be the NSC_NATIVE=<0|1> setting of the build
 	if [[ $interface == @(c|both) ]]; then
-		comp_output=$(bash comp.sh 2>&1) # compiling
+		comp_output=$(env $1 bash comp.sh 2>&1) # compiling
 		if [[ ${#comp_output} -ne 0 ]]; then
 			echo -e "\e[1;31mFailed to compile your C module with \`\033[4;31mcomp.sh\e[0m\e[1;31m\`!\n"
 			youre_a_bozo
@@ -389,18 +582,31 @@ function comprehensive_test() {
 	fi
 	
 	if [[ $interface == @(py|both) ]]; then
-		build_output=$(python3 setup.py build_ext --inplace 2>&1 1>/dev/null)
+		build_output=$(env $1 python3 setup.py build_ext --inplace --force 2>&1 1>/dev/null)
 		if [[ ${#build_output} -ne 0 ]]; then
 			echo -e "\e[1;31mFailed to build the CPython extension with \`\033[4;31msetup.py\e[0m\e[1;31m\`!\n"
 			youre_a_bozo
 		fi
 	fi
+}
+
+
+function comprehensive_test() {
+
+	mkdir ./tmp &> /dev/null
+
+	# Trying to build the necessary resources
+	build NSC_NATIVE=$NSC_NATIVE
 	
 	# Running the necessary tests
 	if [[ $regular == "yes" || $leaks == "yes" ]]; then
 		regular_test
 	fi
 	
+	if [[ $regular == "yes" && $NSC_NATIVE != "1" ]]; then
+		native_test
+	fi
+	
 	if [[ $efficiency == "yes" ]]; then
 		efficiency_test
 	fi
@@ -434,6 +640,7 @@ function instructions() {
 (5) Only failed tests' results are saved into their transcript.
 (6) Efficiency tests become invalid when running on tau-related server (e.g., nova).
 (7) Python memory test is very slow (10 minutes) and doesn't run on Nova.
+(8) On a CPU with AVX2/FMA the regular tests run a second time on an \`\033[4;37mNSC_NATIVE=1\e[0m\` build, with transcripts in \`\033[4;37m<results_dir>/native\e[0m\`. \`\033[4;37mNSC_NATIVE=1 bash tester.sh ...\e[0m\` tests only that build.
 
 \e[4;37m\e[1;37mInstructions\e[0m:
 (1) Avoid any build/dist/egg directories/files from the working directory. Could potentially lead to undefined behaviors of the test script.